@@ -60,7 +60,7 @@ make_aligned_unique(Args&&... args) {
   if (uninit==nullptr) throw std::bad_alloc();
   aligned_unique_ptr<T> rv(new (uninit.get()) T(std::forward<Args>(args)...));
   uninit.release();  // release *after* we know T() didn't throw.
-  return std::move(rv);
+  return rv;
 }
 
 template <class ArrayT,size_t align>
@@ -74,7 +74,7 @@ make_aligned_unique(size_t n) {
   if (uninit==nullptr) throw std::bad_alloc();
   aligned_unique_ptr<T[]> rv(new (uninit.get()) T[n], free_deleter<T[]>(n));
   uninit.release();  // release *after* we know ctors didn't throw.
-  return std::move(rv);
+  return rv;
 }
 
 template <class BoundedArrayT, size_t align>
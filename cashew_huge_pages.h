@@ -0,0 +1,195 @@
+// A chunk source for CashewSlab (see slab_unique.h) that backs tree nodes with
+// 2 MB huge pages. Big sets miss the TLB on almost every level of a lookup if
+// families are scattered over 4 KB pages. With huge pages, one TLB entry
+// covers a couple of thousand families.
+//
+// Each chunk is one or more whole huge pages. We first ask for them with
+// MAP_HUGETLB, which only works if the administrator has reserved huge pages
+// (vm.nr_hugepages). If that fails, we map ordinary memory aligned to 2 MB
+// and ask for transparent huge pages with madvise(MADV_HUGEPAGE). The kernel
+// may or may not honour that, so cashew_huge_page_stats() reports how much
+// memory actually ended up on huge pages.
+//
+// Only Linux is supported. Elsewhere, this falls back to aligned_alloc.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "slab_unique.h"
+
+namespace cashew {
+
+// What is mapped right now, summed over all sets using CashewHugePageChunks.
+struct CashewHugePageStats {
+  size_t mapped_nbytes;    // All memory held by chunks.
+  size_t hugetlb_nbytes;   // Of that, how much came from MAP_HUGETLB.
+  size_t madvised_nbytes;  // How much fell back to madvise(MADV_HUGEPAGE).
+  // How much is on huge pages right now: all of hugetlb_nbytes, plus whatever
+  // /proc/self/smaps says the kernel gave us out of madvised_nbytes.
+  size_t huge_nbytes;
+};
+
+struct CashewHugePageChunks {
+  static constexpr size_t huge_page_nbytes = 2*1024*1024;
+  static constexpr size_t target_chunk_nbytes = huge_page_nbytes;
+  // Returns nullptr if out of memory.
+  static void* allocate(size_t align, size_t nbytes);
+  // Unmaps a chunk. nbytes has to be what it was allocated with.
+  static void deallocate(void* p, size_t nbytes) noexcept;
+  static CashewHugePageStats stats();
+
+ private:
+  using Range = std::pair<uintptr_t,uintptr_t>;  // [begin,end)
+  // Never destroyed, like CashewSlab::instance().
+  struct Registry {
+    std::mutex mutex;
+    CashewHugePageStats stats = {};
+    std::vector<Range> hugetlb;
+    std::vector<Range> madvised;
+  };
+  static Registry& registry() {
+    static Registry* r = new Registry;
+    return *r;
+  }
+  static size_t smapsHugeNbytes(const std::vector<Range>& ranges);
+  // Returns false if begin doesn't start any of ranges.
+  static bool eraseRange(std::vector<Range>& ranges, uintptr_t begin) {
+    for(auto& range : ranges) if(range.first==begin) {
+      range = ranges.back();
+      ranges.pop_back();
+      return true;
+    }
+    return false;
+  }
+};
+
+inline void* CashewHugePageChunks::allocate(size_t align, size_t nbytes) {
+  Registry& r = registry();
+#if defined(__linux__)
+  if(align>huge_page_nbytes) return nullptr;
+  const size_t len = (nbytes+huge_page_nbytes-1)/huge_page_nbytes
+                     * huge_page_nbytes;
+  const int prot = PROT_READ|PROT_WRITE;
+  const int flags = MAP_PRIVATE|MAP_ANONYMOUS;
+  void* p;
+#ifdef MAP_HUGETLB
+  p = mmap(nullptr,len,prot,flags|MAP_HUGETLB,-1,0);
+  if(p!=MAP_FAILED) {
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.stats.mapped_nbytes += len;
+    r.stats.hugetlb_nbytes += len;
+    r.hugetlb.emplace_back(begin,begin+len);
+    return p;
+  }
+#endif
+  // Transparent huge pages only go into 2 MB aligned ranges. So map an extra
+  // page worth, and trim both ends.
+  p = mmap(nullptr,len+huge_page_nbytes,prot,flags,-1,0);
+  if(p==MAP_FAILED) return nullptr;
+  const uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  const uintptr_t begin = (start+huge_page_nbytes-1)/huge_page_nbytes
+                          * huge_page_nbytes;
+  const uintptr_t end = begin+len;
+  if(begin>start) munmap(p,begin-start);
+  if(start+len+huge_page_nbytes>end)
+    munmap(reinterpret_cast<void*>(end),start+len+huge_page_nbytes-end);
+#ifdef MADV_HUGEPAGE
+  // Failure just means no huge pages. The memory is still good.
+  madvise(reinterpret_cast<void*>(begin),len,MADV_HUGEPAGE);
+#endif
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.stats.mapped_nbytes += len;
+  r.stats.madvised_nbytes += len;
+  r.madvised.emplace_back(begin,end);
+  return reinterpret_cast<void*>(begin);
+#else
+  void* p = aligned_alloc(align,nbytes);
+  if(p==nullptr) return nullptr;
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.stats.mapped_nbytes += nbytes;
+  return p;
+#endif
+}
+
+inline void CashewHugePageChunks::deallocate(void* p,
+                                             size_t nbytes) noexcept {
+  Registry& r = registry();
+#if defined(__linux__)
+  const size_t len = (nbytes+huge_page_nbytes-1)/huge_page_nbytes
+                     * huge_page_nbytes;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.stats.mapped_nbytes -= len;
+    if(eraseRange(r.hugetlb,reinterpret_cast<uintptr_t>(p)))
+      r.stats.hugetlb_nbytes -= len;
+    else if(eraseRange(r.madvised,reinterpret_cast<uintptr_t>(p)))
+      r.stats.madvised_nbytes -= len;
+  }
+  munmap(p,len);
+#else
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.stats.mapped_nbytes -= nbytes;
+  }
+  std::free(p);
+#endif
+}
+
+inline CashewHugePageStats CashewHugePageChunks::stats() {
+  Registry& r = registry();
+  CashewHugePageStats rv;
+  std::vector<Range> ranges;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    rv = r.stats;
+    ranges = r.madvised;
+  }
+  rv.huge_nbytes = rv.hugetlb_nbytes+smapsHugeNbytes(ranges);
+  return rv;
+}
+
+// Adds up AnonHugePages over the mappings that overlap ranges. The kernel
+// merges neighbouring chunks into one mapping, so we only count as much of
+// a mapping as overlaps our own chunks.
+inline size_t CashewHugePageChunks::smapsHugeNbytes(
+    const std::vector<Range>& ranges) {
+  if(ranges.empty()) return 0;
+  FILE* f = std::fopen("/proc/self/smaps","r");
+  if(f==nullptr) return 0;
+  char line[4096];
+  unsigned long lo=0, hi=0;
+  size_t rv = 0;
+  while(std::fgets(line,sizeof(line),f)) {
+    unsigned long a,b,kb;
+    if(std::sscanf(line,"%lx-%lx ",&a,&b)==2) {
+      lo=a;
+      hi=b;
+    }else if(std::sscanf(line,"AnonHugePages: %lu kB",&kb)==1 && kb>0) {
+      size_t overlap = 0;
+      for(auto& range : ranges)
+        if(range.first<hi && lo<range.second)
+          overlap += std::min<uintptr_t>(hi,range.second)
+                     - std::max<uintptr_t>(lo,range.first);
+      rv += std::min<size_t>(kb*1024,overlap);
+    }
+  }
+  std::fclose(f);
+  return rv;
+}
+
+inline CashewHugePageStats cashew_huge_page_stats() {
+  return CashewHugePageChunks::stats();
+}
+
+}  // namespace cashew
@@ -0,0 +1,68 @@
+#include "cashew_set.h"
+#include <cassert>
+#include <cstdint>
+#include <set>
+using namespace cashew;
+using namespace std;
+
+struct HugePageTraits : CashewSetTraits<int32_t> {
+  static constexpr bool huge_page_nodes = true;
+};
+
+void testChunks() {
+  const size_t huge = CashewHugePageChunks::huge_page_nbytes;
+  const CashewHugePageStats before = cashew_huge_page_stats();
+  char* p = static_cast<char*>(CashewHugePageChunks::allocate(64,1000));
+  assert(p!=nullptr);
+#if defined(__linux__)
+  assert(reinterpret_cast<uintptr_t>(p)%huge==0);
+  p[0] = p[huge-1] = 1;  // The whole huge page is ours.
+#endif
+  const CashewHugePageStats after = cashew_huge_page_stats();
+  assert(after.mapped_nbytes>before.mapped_nbytes);
+  assert(after.mapped_nbytes==after.hugetlb_nbytes+after.madvised_nbytes ||
+         after.hugetlb_nbytes+after.madvised_nbytes==0);
+  assert(after.huge_nbytes<=after.mapped_nbytes);
+  CashewHugePageChunks::deallocate(p,1000);
+  const CashewHugePageStats freed = cashew_huge_page_stats();
+  assert(freed.mapped_nbytes==before.mapped_nbytes);
+  assert(freed.hugetlb_nbytes==before.hugetlb_nbytes);
+  assert(freed.madvised_nbytes==before.madvised_nbytes);
+}
+
+// Same tree, different memory. Whether the kernel actually gives us huge
+// pages depends on how it's configured, so we only check that stats add up.
+void checkHugePageSet() {
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,HugePageTraits> s;
+  set<int32_t> ref;
+  for(int i=0;i<200000;++i) {
+    int32_t x = int32_t(i*2654435761u%1000003);
+    s.insert(x);
+    ref.insert(x);
+  }
+  for(int i=0;i<200000;i+=2) {
+    int32_t x = int32_t(i*2654435761u%1000003);
+    s.erase(x);
+    ref.erase(x);
+  }
+  assert(s.size()==ref.size());
+  auto it = ref.begin();
+  for(int32_t x : s) assert(x==*it++);
+
+  const CashewHugePageStats stats = cashew_huge_page_stats();
+  assert(stats.mapped_nbytes>=CashewHugePageChunks::huge_page_nbytes);
+  assert(stats.huge_nbytes<=stats.mapped_nbytes);
+}
+
+void testHugePageSet() {
+  checkHugePageSet();
+  // Empty chunks are unmapped, except for a spare, and one that may still
+  // hold blocks cached by this thread.
+  assert(cashew_huge_page_stats().mapped_nbytes<=
+         2*CashewHugePageChunks::huge_page_nbytes);
+}
+
+int main() {
+  testChunks();
+  testHugePageSet();
+}
@@ -0,0 +1,163 @@
+/* Implements a map on top of cashew_set. The tree is exactly the same: each
+   node still has a 64-byte line holding just the keys, so a lookup still only
+   touches one cache line per level. The values live out of line, in whole
+   cache lines stored just before the keys of their node. They only get
+   touched once we have found the key we were looking for.
+
+   Since keys and values are stored separately, we can't hand out references
+   to std::pair<const Key,T> the way std::map does. Instead, iterators
+   dereference to a std::pair<const Key&,T&> of references.
+ */
+
+#pragma once
+
+#include <stdexcept>
+#include <utility>
+
+#include "cashew_set.h"
+
+namespace cashew {
+
+template <class Key, class T, class Less = std::less<Key>,
+          class Eq = std::equal_to<Key>,
+          class Traits = CashewSetTraits<Key>,
+          class Alloc = CashewDefaultAllocator<Key,Traits>>
+class cashew_map {
+  using tree_type = cashew_set<Key,Less,Eq,Traits,Alloc,T>;
+  using tree_iterator = typename tree_type::const_iterator;
+ public:
+  using key_type = typename Traits::key_type;
+  using mapped_type = T;
+  using value_type = std::pair<const key_type,mapped_type>;
+  using size_type = typename tree_type::size_type;
+  using allocator_type = Alloc;
+  cashew_map() = default;
+  explicit cashew_map(const Alloc& a) : tree(a) {}
+  allocator_type get_allocator() const { return tree.get_allocator(); }
+
+  // Like cashew_set iterators, any insertion or erase invalidates all
+  // iterators.
+  template <bool is_const> class basic_iterator;
+  using iterator = basic_iterator<false>;
+  using const_iterator = basic_iterator<true>;
+
+  iterator begin() { return iterator(tree.begin()); }
+  iterator end() { return iterator(tree.end()); }
+  const_iterator begin() const { return const_iterator(tree.begin()); }
+  const_iterator end() const { return const_iterator(tree.end()); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  size_type size() const noexcept { return tree.size(); }
+  bool empty() const noexcept { return tree.empty(); }
+  void clear() noexcept { tree.clear(); }
+  size_type count(const key_type& key) const { return tree.count(key); }
+  size_type erase(const key_type& key) { return tree.erase(key); }
+
+  iterator find(const key_type& key) { return iterator(tree.find(key)); }
+  const_iterator find(const key_type& key) const {
+    return const_iterator(tree.find(key));
+  }
+  iterator lower_bound(const key_type& key) {
+    return iterator(tree.lower_bound(key));
+  }
+  const_iterator lower_bound(const key_type& key) const {
+    return const_iterator(tree.lower_bound(key));
+  }
+  iterator upper_bound(const key_type& key) {
+    return iterator(tree.upper_bound(key));
+  }
+  const_iterator upper_bound(const key_type& key) const {
+    return const_iterator(tree.upper_bound(key));
+  }
+
+  // Value-initializes the value if key is new.
+  mapped_type& operator[](const key_type& key) {
+    auto rv = tree.emplaceKey(key).first;
+    return rv.node->value(rv.pos);
+  }
+  mapped_type& operator[](key_type&& key) {
+    auto rv = tree.emplaceKey(std::move(key)).first;
+    return rv.node->value(rv.pos);
+  }
+  mapped_type& at(const key_type& key) {
+    return const_cast<mapped_type&>(
+        static_cast<const cashew_map*>(this)->at(key));
+  }
+  const mapped_type& at(const key_type& key) const {
+    tree_iterator it = tree.find(key);
+    if(it==tree.end()) throw std::out_of_range("cashew_map::at");
+    return valueAt(it);
+  }
+  // Constructs a value from args only if key is new. Otherwise, leaves args
+  // untouched.
+  template <class... Args>
+  std::pair<iterator,bool> try_emplace(const key_type& key, Args&&... args) {
+    auto rv = tree.emplaceKey(key,std::forward<Args>(args)...);
+    return {iterator(tree.iteratorAt(rv.first.node,rv.first.pos)),rv.second};
+  }
+  // Moves from key only if it's new.
+  template <class... Args>
+  std::pair<iterator,bool> try_emplace(key_type&& key, Args&&... args) {
+    auto rv = tree.emplaceKey(std::move(key),std::forward<Args>(args)...);
+    return {iterator(tree.iteratorAt(rv.first.node,rv.first.pos)),rv.second};
+  }
+  template <class M>
+  std::pair<iterator,bool> insert_or_assign(const key_type& key, M&& obj) {
+    auto rv = tree.emplaceKey(key,std::forward<M>(obj));
+    if(!rv.second) rv.first.node->value(rv.first.pos)=std::forward<M>(obj);
+    return {iterator(tree.iteratorAt(rv.first.node,rv.first.pos)),rv.second};
+  }
+  std::pair<iterator,bool> insert(const value_type& kv) {
+    return try_emplace(kv.first,kv.second);
+  }
+
+ private:
+  tree_type tree;
+
+  static mapped_type& valueAt(const tree_iterator& it) {
+    using node_type = typename tree_type::node_type;
+    node_type* node = const_cast<node_type*>(it.node_);
+    return node->value(it.cur_);
+  }
+};
+
+template <class Key, class T, class Less, class Eq, class Traits, class Alloc>
+template <bool is_const>
+class cashew_map<Key,T,Less,Eq,Traits,Alloc>::basic_iterator {
+ public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename cashew_map::value_type;
+  using difference_type = ptrdiff_t;
+  using reference = std::pair<const key_type&,
+        typename std::conditional<is_const,const mapped_type&,
+                                           mapped_type&>::type>;
+  // operator-> needs to return something that behaves like a pointer.
+  struct pointer {
+    reference ref;
+    const reference* operator->() const { return &ref; }
+  };
+
+  basic_iterator() {}
+  // iterator converts to const_iterator, but not the other way around.
+  template <bool that_const,
+            class = typename std::enable_if<is_const || !that_const>::type>
+  basic_iterator(const basic_iterator<that_const>& that) : it_(that.it_) {}
+
+  reference operator*() const { return reference(*it_,valueAt(it_)); }
+  pointer operator->() const { return pointer{**this}; }
+  basic_iterator& operator++() { ++it_; return *this; }
+  basic_iterator& operator--() { --it_; return *this; }
+  basic_iterator operator++(int) { return basic_iterator(it_++); }
+  basic_iterator operator--(int) { return basic_iterator(it_--); }
+  bool operator==(const basic_iterator& that) const { return it_==that.it_; }
+  bool operator!=(const basic_iterator& that) const { return it_!=that.it_; }
+
+ private:
+  friend class cashew_map;
+  template <bool> friend class basic_iterator;
+  explicit basic_iterator(const tree_iterator& it) : it_(it) {}
+  tree_iterator it_;
+};
+
+}  // namespace cashew
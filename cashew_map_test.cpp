@@ -0,0 +1,127 @@
+#include "cashew_map.h"
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace cashew;
+using namespace std;
+
+void testNodeLayout() {
+  using node_type = CashewSetNode<int32_t,CashewSetTraits<int32_t>,int64_t>;
+  // 13 int64_t values need two cache lines.
+  static_assert(sizeof(node_type) == 3*64, "Unexpected map node size");
+  node_type node;
+  // Keys stay on a line of their own.
+  assert((reinterpret_cast<char*>(&node.elt(0))-reinterpret_cast<char*>(&node))
+      /64 == 2);
+}
+
+void testBasicOps() {
+  cashew_map<int32_t,string> m;
+  assert(m.empty());
+  assert(m.find(1)==m.end());
+  m[1]="one";
+  m[2]="two";
+  assert(m.size()==2);
+  assert(m.find(1)->second=="one");
+  assert(m.at(2)=="two");
+  try {
+    m.at(3);
+    assert(false);
+  }catch(const out_of_range&) {}
+
+  // try_emplace doesn't touch existing values.
+  auto r = m.try_emplace(1,"uno");
+  assert(!r.second && r.first->second=="one");
+  r = m.try_emplace(3,3,'x');
+  assert(r.second && r.first->first==3 && r.first->second=="xxx");
+
+  // insert_or_assign does.
+  r = m.insert_or_assign(1,string("uno"));
+  assert(!r.second && m[1]=="uno");
+  r = m.insert_or_assign(4,"four");
+  assert(r.second && m[4]=="four");
+
+  (*m.find(4)).second+="!";
+  assert(m.at(4)=="four!");
+  assert(m.erase(4)==1);
+  assert(m.count(4)==0);
+  assert(m.size()==3);
+}
+
+struct SortedTraits : CashewSetTraits<int32_t> {
+  static constexpr bool sorted_within_node = true;
+};
+struct WideLeafTraits : CashewSetTraits<int32_t> {
+  static constexpr bool wide_leaves = true;
+};
+
+// Compares against std::map, while values get shuffled around by splits and
+// merges.
+template <class Traits> void testRandomOps() {
+  vector<int> v(100000);
+  for(size_t i=0;i<v.size();++i) v[i]=int(i);
+  random_shuffle(v.begin(),v.end());
+
+  cashew_map<int32_t,unique_ptr<int>,less<int32_t>,equal_to<int32_t>,Traits> m;
+  map<int32_t,int> expected;
+  for(int x:v) {
+    m.try_emplace(x,new int(3*x));
+    expected[x]=3*x;
+  }
+  random_shuffle(v.begin(),v.end());
+  for(size_t i=0;i<v.size()/2;++i) {
+    m.erase(v[i]);
+    expected.erase(v[i]);
+  }
+  for(size_t i=0;i<v.size()/2;i+=2) {
+    m[v[i]].reset(new int(-v[i]));
+    expected[v[i]]=-v[i];
+  }
+
+  assert(m.size()==expected.size());
+  auto it = expected.begin();
+  for(auto kv : m) {
+    assert(kv.first==it->first && *kv.second==it->second);
+    ++it;
+  }
+  const auto& cm = m;
+  for(auto kv : expected) assert(*cm.find(kv.first)->second==kv.second);
+  assert(*m.lower_bound(v[0]-1)->second==expected.lower_bound(v[0]-1)->second);
+}
+
+struct ValueLifeCount {
+  static int born;
+  static int died;
+  int x;
+  explicit ValueLifeCount(int x) : x(x) { born++; }
+  ValueLifeCount(ValueLifeCount&& that) noexcept : x(that.x) { born++; }
+  ValueLifeCount& operator=(ValueLifeCount&&) noexcept = default;
+  ~ValueLifeCount() { died++; }
+};
+int ValueLifeCount::born = 0;
+int ValueLifeCount::died = 0;
+
+void testValueDtorInvocation() {
+  {
+    cashew_map<int32_t,ValueLifeCount> m;
+    for(int i=0;i<1000;++i) m.try_emplace(i*7%1000,i);
+    for(int i=0;i<1000;i+=3) m.erase(i);
+    for(int k=0;k<1000;++k)
+      if(k%3) assert(m.at(k).x*7%1000==k);
+  }
+  assert(ValueLifeCount::born==ValueLifeCount::died);
+}
+
+int main() {
+  testNodeLayout();
+  testBasicOps();
+  testRandomOps<CashewSetTraits<int32_t>>();
+  // Keeping nodes sorted shifts values around on every insert and erase.
+  testRandomOps<SortedTraits>();
+  // Leaves have more values than other nodes.
+  testRandomOps<WideLeafTraits>();
+  testValueDtorInvocation();
+}
@@ -0,0 +1,119 @@
+/* A multiset that keeps each distinct key once, along with a run count of how
+   many copies of it are present. Duplicates therefore cost nothing beyond the
+   counter, which is stored out of line the same way cashew_map stores its
+   values: the key line of every node is untouched, so count(key) is still a
+   single descent that reads one key line per level, plus the one counter line
+   of the node where the key was found.
+
+   Iteration visits each distinct key once, as a (key, count) pair, in sorted
+   order. This is usually what counting pipelines want anyway.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#include "cashew_map.h"
+
+namespace cashew {
+
+template <class Key, class Less = std::less<Key>,
+          class Eq = std::equal_to<Key>,
+          class Traits = CashewSetTraits<Key>, class Count = uint32_t,
+          class Alloc = CashewDefaultAllocator<Key,Traits>>
+class cashew_multiset {
+  using map_type = cashew_map<Key,Count,Less,Eq,Traits,Alloc>;
+  static_assert(std::is_unsigned<Count>::value,
+                "cashew_multiset counts must be unsigned");
+ public:
+  using key_type = typename Traits::key_type;
+  using value_type = key_type;
+  using count_type = Count;
+  using size_type = size_t;
+  using allocator_type = Alloc;
+  cashew_multiset() = default;
+  explicit cashew_multiset(const Alloc& a) : runs(a) {}
+  allocator_type get_allocator() const { return runs.get_allocator(); }
+  // Dereferences to std::pair<const key_type&,const count_type&>.
+  using const_iterator = typename map_type::const_iterator;
+  using iterator = const_iterator;
+
+  const_iterator begin() const { return runs.begin(); }
+  const_iterator end() const { return runs.end(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  // Total number of elements, duplicates included.
+  size_type size() const noexcept { return total; }
+  size_type distinct_size() const noexcept { return runs.size(); }
+  bool empty() const noexcept { return runs.empty(); }
+  void clear() noexcept { runs.clear(); total=0; }
+
+  // Adds n copies of key. Returns the new multiplicity of key. Throws
+  // std::overflow_error, leaving the multiset unchanged, if that does not fit
+  // in count_type.
+  size_type insert(const key_type& key, size_type n = 1);
+  size_type count(const key_type& key) const {
+    auto it = runs.find(key);
+    return it==runs.end() ? 0 : it->second;
+  }
+  // Removes all copies of key. Returns how many were removed.
+  size_type erase(const key_type& key);
+  // Removes a single copy of key. Returns false if there wasn't any.
+  bool erase_one(const key_type& key);
+
+  const_iterator find(const key_type& key) const { return runs.find(key); }
+  const_iterator lower_bound(const key_type& key) const {
+    return runs.lower_bound(key);
+  }
+  const_iterator upper_bound(const key_type& key) const {
+    return runs.upper_bound(key);
+  }
+
+ private:
+  map_type runs;
+  size_type total = 0;
+};
+
+template <class Key, class Less, class Eq, class Traits, class Count,
+          class Alloc>
+auto cashew_multiset<Key,Less,Eq,Traits,Count,Alloc>::insert(
+    const key_type& key, size_type n) -> size_type {
+  if(n==0) return count(key);
+  auto rv = runs.try_emplace(key,count_type(0));
+  count_type& c = rv.first->second;
+  if(n>size_type(count_type(-1)-c)) {
+    if(rv.second) runs.erase(key);
+    throw std::overflow_error("cashew_multiset::insert");
+  }
+  c += n;
+  total += n;
+  return c;
+}
+
+template <class Key, class Less, class Eq, class Traits, class Count,
+          class Alloc>
+auto cashew_multiset<Key,Less,Eq,Traits,Count,Alloc>::erase(const key_type& key)
+  -> size_type {
+  size_type rv = count(key);
+  if(rv==0) return 0;
+  runs.erase(key);
+  total -= rv;
+  return rv;
+}
+
+template <class Key, class Less, class Eq, class Traits, class Count,
+          class Alloc>
+bool cashew_multiset<Key,Less,Eq,Traits,Count,Alloc>::erase_one(
+    const key_type& key) {
+  auto it = runs.find(key);
+  if(it==runs.end()) return false;
+  if(it->second==1) runs.erase(key);
+  else --it->second;
+  --total;
+  return true;
+}
+
+}  // namespace cashew
@@ -0,0 +1,93 @@
+#include "cashew_multiset.h"
+#include <cassert>
+#include <map>
+#include <random>
+#include <stdexcept>
+using namespace cashew;
+using namespace std;
+
+void testBasicOps() {
+  cashew_multiset<int32_t> s;
+  assert(s.empty() && s.count(5)==0);
+  assert(s.insert(5)==1);
+  assert(s.insert(5)==2);
+  assert(s.insert(3,4)==4);
+  assert(s.insert(7,0)==0);
+  assert(s.count(7)==0 && s.distinct_size()==2);
+  assert(s.size()==6);
+  auto it = s.begin();
+  assert(it->first==3 && it->second==4);
+  ++it;
+  assert(it->first==5 && it->second==2);
+  assert(++it==s.end());
+  assert(s.erase_one(5) && s.count(5)==1);
+  assert(s.erase_one(5) && s.count(5)==0);
+  assert(!s.erase_one(5));
+  assert(s.erase(3)==4 && s.erase(3)==0);
+  assert(s.empty() && s.size()==0);
+}
+
+void testOverflow() {
+  cashew_multiset<int32_t,less<int32_t>,equal_to<int32_t>,
+                  CashewSetTraits<int32_t>,uint8_t> s;
+  assert(s.insert(1,255)==255);
+  try {
+    s.insert(1);
+    assert(false);
+  }catch(const overflow_error&) {}
+  assert(s.count(1)==255 && s.size()==255);
+  try {
+    s.insert(2,256);
+    assert(false);
+  }catch(const overflow_error&) {}
+  assert(s.count(2)==0 && s.distinct_size()==1);
+}
+
+void testRandomOps() {
+  minstd_rand rng(42);
+  cashew_multiset<uint16_t> s;
+  map<uint16_t,size_t> ref;
+  size_t total = 0;
+  for(int i=0;i<200000;++i) {
+    uint16_t x = rng()%2000;
+    switch(rng()%4) {
+      case 0:
+      case 1: {
+        size_t n = rng()%3;
+        total+=n;
+        if(n) ref[x]+=n;
+        assert(s.insert(x,n)==(n?ref[x]:s.count(x)));
+        break;
+      }
+      case 2:
+        if(ref.count(x)) {
+          assert(s.erase_one(x));
+          --total;
+          if(--ref[x]==0) ref.erase(x);
+        }else assert(!s.erase_one(x));
+        break;
+      case 3:
+        if(rng()%8==0) {
+          size_t n = ref.count(x)?ref[x]:0;
+          assert(s.erase(x)==n);
+          ref.erase(x);
+          total-=n;
+        }else assert(s.count(x)==(ref.count(x)?ref[x]:0));
+        break;
+    }
+  }
+  assert(s.size()==total && s.distinct_size()==ref.size());
+  auto it = ref.begin();
+  for(auto kv : s) {
+    assert(kv.first==it->first && kv.second==it->second);
+    ++it;
+  }
+  assert(it==ref.end());
+  assert(s.lower_bound(1000)->first==ref.lower_bound(1000)->first);
+}
+
+int main() {
+  testBasicOps();
+  testOverflow();
+  testRandomOps();
+}
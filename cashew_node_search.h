@@ -0,0 +1,475 @@
+/* Searching for a key within a single node. This is the inner loop of every
+   lookup and insert, so it gets its own header.
+
+   The generic version is a plain linear scan, calling eq() and less() on
+   each element. For integer keys with the default comparators, we can do
+   better: the whole 64-byte line of a node fits in a few vector registers,
+   and both the match and lessCount fall out of a couple of compares. Slots
+   past elt_count(), along with the family pointer and count at the start of
+   the line, just get masked off. Wide leaves (Traits::wide_leaves) have
+   elements in place of the family pointer, which are left unmasked.
+
+   The line is loaded starting at &node.family, which is where the keys'
+   cache line begins, whether or not the node has values in front of it
+   (see CashewNodeValues). Loads are unaligned, since the root node lives
+   inside cashew_set, and need not be 64-byte aligned.
+
+   Small keys gain the most from this: a node holds 55 uint8_t keys, or 27
+   uint16_t keys, which the scalar loop would go through one at a time.
+
+   Nodes that keep their elements sorted (Traits::sorted_within_node) get a
+   binary search instead of the scalar loop. Vector kernels still scan the
+   whole line, sorted or not: that's a couple of instructions either way.
+
+   Vector kernels are compiled for SSE4.2, AVX2 and AVX-512 regardless of
+   compiler flags, using target attributes. Which one runs is decided at run
+   time, from what the CPU supports. See CashewSearchTier below. On compilers
+   or machines where we can't do that, everything goes through the scalar
+   loop.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CASHEW_X86_DISPATCH 1
+#include <immintrin.h>
+#define CASHEW_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CASHEW_X86_DISPATCH 0
+#endif
+
+namespace cashew {
+
+// Node search kernels, from slowest to fastest. The AVX-512 tier needs both
+// AVX-512F and AVX-512BW, the latter for 8-bit and 16-bit keys. SSE4.2 only
+// has kernels for 32-bit and 64-bit keys, and leaves smaller keys to the
+// scalar loop.
+enum class CashewSearchTier : char { scalar, sse42, avx2, avx512 };
+
+// The fastest tier this CPU supports.
+inline CashewSearchTier cashew_best_search_tier() {
+#if CASHEW_X86_DISPATCH
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return CashewSearchTier::avx512;
+  if(__builtin_cpu_supports("avx2")) return CashewSearchTier::avx2;
+  if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    return CashewSearchTier::sse42;
+#endif
+  return CashewSearchTier::scalar;
+}
+
+inline CashewSearchTier& cashew_search_tier_ref() {
+  static CashewSearchTier tier = cashew_best_search_tier();
+  return tier;
+}
+
+// The tier currently used by every cashew_set.
+inline CashewSearchTier cashew_search_tier() {
+  return cashew_search_tier_ref();
+}
+
+// Makes every cashew_set use the given tier from now on, e.g. to compare
+// tiers on a single machine. Returns false, and changes nothing, if the CPU
+// doesn't support it. This is not synchronized with searches going on in
+// other threads, so call it before any of them start.
+inline bool cashew_force_search_tier(CashewSearchTier tier) {
+  if(tier>cashew_best_search_tier()) return false;
+  cashew_search_tier_ref() = tier;
+  return true;
+}
+
+// Linear scan, for any key type. The scalar searches take any Key that Less
+// and Eq can compare with elements, for transparent lookups.
+template <class Elt, class Less, class Eq, class Traits>
+struct CashewScanSearch {
+  using elt_count_type = typename Traits::elt_count_type;
+  template <class Node, class Key>
+  static elt_count_type find(const Node& node, const Key& key,
+                             const Less& less, const Eq& eq,
+                             elt_count_type& lessCount) {
+    lessCount = 0;
+    for(elt_count_type i=0;i<node.elt_count();++i)
+      if(eq(node.elt(i),key)) return i;
+      else if(less(node.elt(i),key)) lessCount++;
+    return -1;
+  }
+};
+
+// Compares slots i..n-1 of a node with key. Sets one bit per matching slot
+// in eqBits, and counts how many of the first count slots are less than key.
+// Nothing here branches on the result of a comparison.
+template <int i, int n> struct CashewUnrolledScan {
+  template <class Node, class Key, class Less, class Eq>
+  static void scan(const Node& node, const Key& key, const Less& less,
+                   const Eq& eq, int count, uint64_t& eqBits, int& lessCount) {
+    const auto& e = node.elt(i);
+    eqBits |= uint64_t(eq(e,key))<<i;
+    lessCount += int(less(e,key)) & int(i<count);
+    CashewUnrolledScan<i+1,n>::scan(node,key,less,eq,count,eqBits,lessCount);
+  }
+};
+
+template <int n> struct CashewUnrolledScan<n,n> {
+  template <class Node, class Key, class Less, class Eq>
+  static void scan(const Node&, const Key&, const Less&, const Eq&, int,
+                   uint64_t&, int&) {}
+};
+
+// Linear scan unrolled to exactly leaf_elt_count_max slots, for any
+// comparator.
+// With random keys, the early exit and the branch on less() in
+// CashewScanSearch mispredict a lot. This always does the same amount of
+// work instead, and masks off slots past elt_count(). Those slots hold stale
+// or zeroed bytes (see CashewSetNode), so keys need to be trivially
+// copyable, and comparisons have to be safe to run on any bit pattern.
+template <class Elt, class Less, class Eq, class Traits>
+struct CashewBranchlessSearch {
+  using elt_count_type = typename Traits::elt_count_type;
+  template <class Node, class Key>
+  static elt_count_type find(const Node& node, const Key& key,
+                             const Less& less, const Eq& eq,
+                             elt_count_type& lessCount) {
+    static_assert(std::is_trivially_copyable<Elt>::value,
+        "Branchless node search needs trivially copyable keys");
+    static_assert(Node::leaf_elt_count_max<64, "Too many slots for a mask");
+    const int count = node.elt_count();
+    uint64_t eqBits = 0;
+    int lt = 0;
+    CashewUnrolledScan<0,Node::leaf_elt_count_max>::scan(
+        node,key,less,eq,count,eqBits,lt);
+    eqBits &= (uint64_t(1)<<count)-1;
+    lessCount = lt;
+    if(eqBits!=0) return __builtin_ctzll(eqBits);
+    return -1;
+  }
+};
+
+// Binary search, for nodes that keep elts() sorted. The only branch is on
+// the size of the range, which does not depend on key, so the compiler can
+// turn the choice of half into a conditional move.
+template <class Elt, class Less, class Eq, class Traits>
+struct CashewBinarySearch {
+  using elt_count_type = typename Traits::elt_count_type;
+  template <class Node, class Key>
+  static elt_count_type find(const Node& node, const Key& key,
+                             const Less& less, const Eq& eq,
+                             elt_count_type& lessCount) {
+    const int count = node.elt_count();
+    if(count==0) { lessCount = 0; return -1; }
+    const Elt* first = &node.elt(0);
+    const Elt* base = first;
+    for(int n=count;n>1;) {
+      const int half = n/2;
+      base = less(base[half],key) ? base+half : base;
+      n -= half;
+    }
+    const int i = (base-first)+less(*base,key);
+    lessCount = i;
+    if(i<count && eq(first[i],key)) return i;
+    return -1;
+  }
+};
+
+// Whichever non-vector search Traits asks for.
+template <class Elt, class Less, class Eq, class Traits>
+using cashew_scalar_search = typename std::conditional<
+  Traits::sorted_within_node,
+  CashewBinarySearch<Elt,Less,Eq,Traits>,
+  typename std::conditional<Traits::branchless_node_search,
+    CashewBranchlessSearch<Elt,Less,Eq,Traits>,
+    CashewScanSearch<Elt,Less,Eq,Traits>>::type>::type;
+
+// Looks for key among node.elts(). Returns its index, or -1 if it isn't
+// there. In the latter case, also sets lessCount to the number of elements
+// less than key, which is the child to search next. If key is found,
+// lessCount is still set, so that callers never read it uninitialized, but
+// its value means nothing.
+template <class Elt, class Less, class Eq, class Traits, class Enable = void>
+struct CashewNodeSearch : cashew_scalar_search<Elt,Less,Eq,Traits> {};
+
+#if CASHEW_X86_DISPATCH
+
+// Each kernel compares every lane of a 64-byte line with key, and looks only
+// at the lanes set in valid. Sets lessCount to the number of lanes less than
+// key, and returns the lane equal to key if there is one, or -1. Lanes
+// are compared as signed integers, so unsigned keys are biased by the sign
+// bit first.
+
+CASHEW_TARGET("sse4.2,popcnt")
+inline int cashew_line_find_sse42(const char* line, int32_t key, int32_t bias,
+                                  uint64_t valid, int& lessCount) {
+  const __m128i b = _mm_set1_epi32(bias);
+  const __m128i k = _mm_xor_si128(_mm_set1_epi32(key),b);
+  uint32_t eqMask = 0, ltMask = 0;
+  for(int i=0;i<4;++i) {
+    const __m128i x = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(line+16*i)),b);
+    eqMask |= uint32_t(_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(x,k))))<<4*i;
+    ltMask |= uint32_t(_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpgt_epi32(k,x))))<<4*i;
+  }
+  lessCount = __builtin_popcount(ltMask&valid);
+  eqMask &= valid;
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("sse4.2,popcnt")
+inline int cashew_line_find_sse42(const char* line, int64_t key, int64_t bias,
+                                  uint64_t valid, int& lessCount) {
+  const __m128i b = _mm_set1_epi64x(bias);
+  const __m128i k = _mm_xor_si128(_mm_set1_epi64x(key),b);
+  uint32_t eqMask = 0, ltMask = 0;
+  for(int i=0;i<4;++i) {
+    const __m128i x = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(line+16*i)),b);
+    eqMask |= uint32_t(_mm_movemask_pd(_mm_castsi128_pd(
+            _mm_cmpeq_epi64(x,k))))<<2*i;
+    ltMask |= uint32_t(_mm_movemask_pd(_mm_castsi128_pd(
+            _mm_cmpgt_epi64(k,x))))<<2*i;
+  }
+  lessCount = __builtin_popcount(ltMask&valid);
+  eqMask &= valid;
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("avx2,popcnt")
+inline int cashew_line_find_avx2(const char* line, int32_t key, int32_t bias,
+                                 uint64_t valid, int& lessCount) {
+  const __m256i b = _mm256_set1_epi32(bias);
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(key),b);
+  const __m256i lo = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line)),b);
+  const __m256i hi = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line+32)),b);
+  uint32_t eqMask =
+    uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(lo,k))))
+    | uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpeq_epi32(hi,k))))<<8;
+  const uint32_t ltMask =
+    uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k,lo))))
+    | uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(
+            _mm256_cmpgt_epi32(k,hi))))<<8;
+  lessCount = __builtin_popcount(ltMask&valid);
+  eqMask &= valid;
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("avx2,popcnt")
+inline int cashew_line_find_avx2(const char* line, int64_t key, int64_t bias,
+                                 uint64_t valid, int& lessCount) {
+  const __m256i b = _mm256_set1_epi64x(bias);
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key),b);
+  const __m256i lo = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line)),b);
+  const __m256i hi = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line+32)),b);
+  uint32_t eqMask =
+    uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(lo,k))))
+    | uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpeq_epi64(hi,k))))<<4;
+  const uint32_t ltMask =
+    uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,lo))))
+    | uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpgt_epi64(k,hi))))<<4;
+  lessCount = __builtin_popcount(ltMask&valid);
+  eqMask &= valid;
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+// AVX-512 compares produce lane masks directly, and can be restricted to the
+// valid lanes up front.
+CASHEW_TARGET("avx512f,popcnt")
+inline int cashew_line_find_avx512(const char* line, int32_t key, int32_t bias,
+                                   uint64_t valid, int& lessCount) {
+  const __m512i b = _mm512_set1_epi32(bias);
+  const __m512i k = _mm512_xor_si512(_mm512_set1_epi32(key),b);
+  const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(line),b);
+  const uint32_t eqMask = _mm512_mask_cmpeq_epi32_mask(__mmask16(valid),x,k);
+  lessCount = __builtin_popcount(
+      uint32_t(_mm512_mask_cmplt_epi32_mask(__mmask16(valid),x,k)));
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("avx512f,popcnt")
+inline int cashew_line_find_avx512(const char* line, int64_t key, int64_t bias,
+                                   uint64_t valid, int& lessCount) {
+  const __m512i b = _mm512_set1_epi64(bias);
+  const __m512i k = _mm512_xor_si512(_mm512_set1_epi64(key),b);
+  const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(line),b);
+  const uint32_t eqMask = _mm512_mask_cmpeq_epi64_mask(__mmask8(valid),x,k);
+  lessCount = __builtin_popcount(
+      uint32_t(_mm512_mask_cmplt_epi64_mask(__mmask8(valid),x,k)));
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+// Kernels for 8-bit and 16-bit keys. With AVX2, the line takes two
+// registers. With AVX-512BW, it's a single masked compare.
+
+CASHEW_TARGET("avx2")
+inline uint64_t cashew_avx2_lane_bits8(__m256i lo, __m256i hi) {
+  return uint64_t(uint32_t(_mm256_movemask_epi8(lo)))
+    | uint64_t(uint32_t(_mm256_movemask_epi8(hi)))<<32;
+}
+
+CASHEW_TARGET("avx2,popcnt")
+inline int cashew_line_find_avx2(const char* line, int8_t key, int8_t bias,
+                                 uint64_t valid, int& lessCount) {
+  const __m256i b = _mm256_set1_epi8(bias);
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi8(key),b);
+  const __m256i lo = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line)),b);
+  const __m256i hi = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line+32)),b);
+  const uint64_t eqMask = cashew_avx2_lane_bits8(
+      _mm256_cmpeq_epi8(lo,k),_mm256_cmpeq_epi8(hi,k)) & valid;
+  lessCount = __builtin_popcountll(cashew_avx2_lane_bits8(
+      _mm256_cmpgt_epi8(k,lo),_mm256_cmpgt_epi8(k,hi)) & valid);
+  if(eqMask!=0) return __builtin_ctzll(eqMask);
+  return -1;
+}
+
+// Packs the two 16-lane compare results into bytes, so that movemask gives
+// one bit per lane. packs works within 128-bit halves, hence the permute.
+CASHEW_TARGET("avx2")
+inline uint32_t cashew_avx2_lane_bits16(__m256i lo, __m256i hi) {
+  return uint32_t(_mm256_movemask_epi8(
+        _mm256_permute4x64_epi64(_mm256_packs_epi16(lo,hi),0xD8)));
+}
+
+CASHEW_TARGET("avx2,popcnt")
+inline int cashew_line_find_avx2(const char* line, int16_t key, int16_t bias,
+                                 uint64_t valid, int& lessCount) {
+  const __m256i b = _mm256_set1_epi16(bias);
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi16(key),b);
+  const __m256i lo = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line)),b);
+  const __m256i hi = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line+32)),b);
+  const uint32_t eqMask = cashew_avx2_lane_bits16(
+      _mm256_cmpeq_epi16(lo,k),_mm256_cmpeq_epi16(hi,k)) & valid;
+  lessCount = __builtin_popcount(cashew_avx2_lane_bits16(
+      _mm256_cmpgt_epi16(k,lo),_mm256_cmpgt_epi16(k,hi)) & valid);
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("avx512f,avx512bw,popcnt")
+inline int cashew_line_find_avx512(const char* line, int8_t key, int8_t bias,
+                                   uint64_t valid, int& lessCount) {
+  const __m512i b = _mm512_set1_epi8(bias);
+  const __m512i k = _mm512_xor_si512(_mm512_set1_epi8(key),b);
+  const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(line),b);
+  const uint64_t eqMask = _mm512_mask_cmpeq_epi8_mask(__mmask64(valid),x,k);
+  lessCount = __builtin_popcountll(
+      uint64_t(_mm512_mask_cmplt_epi8_mask(__mmask64(valid),x,k)));
+  if(eqMask!=0) return __builtin_ctzll(eqMask);
+  return -1;
+}
+
+CASHEW_TARGET("avx512f,avx512bw,popcnt")
+inline int cashew_line_find_avx512(const char* line, int16_t key, int16_t bias,
+                                   uint64_t valid, int& lessCount) {
+  const __m512i b = _mm512_set1_epi16(bias);
+  const __m512i k = _mm512_xor_si512(_mm512_set1_epi16(key),b);
+  const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(line),b);
+  const uint32_t eqMask = _mm512_mask_cmpeq_epi16_mask(__mmask32(valid),x,k);
+  lessCount = __builtin_popcount(
+      uint32_t(_mm512_mask_cmplt_epi16_mask(__mmask32(valid),x,k)));
+  if(eqMask!=0) return __builtin_ctz(eqMask);
+  return -1;
+}
+
+// There are no SSE4.2 kernels for small keys. These are never called, since
+// CashewNodeSearch sends such keys to the scalar loop on that tier. They only
+// exist so that it compiles.
+inline int cashew_line_find_sse42(const char*, int8_t, int8_t, uint64_t,
+                                  int& lessCount) {
+  lessCount = 0;
+  return -1;
+}
+inline int cashew_line_find_sse42(const char*, int16_t, int16_t, uint64_t,
+                                  int& lessCount) {
+  lessCount = 0;
+  return -1;
+}
+
+template <size_t n> struct cashew_lane_type;
+template <> struct cashew_lane_type<1> { using type = int8_t; };
+template <> struct cashew_lane_type<2> { using type = int16_t; };
+template <> struct cashew_lane_type<4> { using type = int32_t; };
+template <> struct cashew_lane_type<8> { using type = int64_t; };
+
+template <class Elt, class Traits>
+struct cashew_line_searchable : std::integral_constant<bool,
+    std::is_integral<Elt>::value && sizeof(Elt)<=8 &&
+    Traits::cache_line_nbytes==64> {};
+
+// Runs the kernel for tier, which is not scalar, over node's line, with
+// every element read as a lane. Returns the index of the element equal to
+// key, or -1. Sets lessCount either way. Other searches with lane-sized
+// elements can use this too.
+template <class Lane, class Node>
+int cashew_node_find_lanes(CashewSearchTier tier, const Node& node, Lane key,
+                           Lane bias, int& lessCount) {
+  const char* line = reinterpret_cast<const char*>(&node.family);
+  // Lane holding elt(0). This is a compile-time constant in practice.
+  const int first =
+    (reinterpret_cast<const char*>(&node.elt(0))-line)/sizeof(Lane);
+  // Wide leaves keep their last few elements in the lanes of the family
+  // pointer, in front of elt(0).
+  const int count = node.elt_count();
+  const int inBuf =
+    Node::leaf_elt_count_max>Node::elt_count_max && count>Node::elt_count_max
+    ? Node::elt_count_max : count;
+  const uint64_t valid = ((uint64_t(1)<<inBuf)-1)<<first
+                         | ((uint64_t(1)<<(count-inBuf))-1);
+  int lane;
+  if(tier==CashewSearchTier::avx512)
+    lane = cashew_line_find_avx512(line,key,bias,valid,lessCount);
+  else if(tier==CashewSearchTier::avx2)
+    lane = cashew_line_find_avx2(line,key,bias,valid,lessCount);
+  else lane = cashew_line_find_sse42(line,key,bias,valid,lessCount);
+  if(lane<0) return -1;
+  return lane>=first?lane-first:Node::elt_count_max+lane;
+}
+
+template <class Elt, class Traits>
+struct CashewNodeSearch<Elt,std::less<Elt>,std::equal_to<Elt>,Traits,
+    typename std::enable_if<cashew_line_searchable<Elt,Traits>::value>::type> {
+  using elt_count_type = typename Traits::elt_count_type;
+  using lane_type = typename cashew_lane_type<sizeof(Elt)>::type;
+  template <class Node>
+  static elt_count_type find(const Node& node, const Elt& key,
+                             const std::less<Elt>& less,
+                             const std::equal_to<Elt>& eq,
+                             elt_count_type& lessCount) {
+    const CashewSearchTier tier = cashew_search_tier();
+    if(tier==CashewSearchTier::scalar ||
+       (tier==CashewSearchTier::sse42 && sizeof(Elt)<4))
+      return cashew_scalar_search<Elt,std::less<Elt>,std::equal_to<Elt>,Traits>
+        ::find(node,key,less,eq,lessCount);
+    const lane_type bias = std::is_signed<Elt>::value
+      ? 0 : std::numeric_limits<lane_type>::min();
+    int lt;
+    const int i = cashew_node_find_lanes(tier,node,lane_type(key),bias,lt);
+    lessCount = lt;
+    return i;
+  }
+};
+
+#endif  // CASHEW_X86_DISPATCH
+
+}  // namespace cashew
@@ -9,6 +9,7 @@
    size: in Intel, AMD, and even ARM processors, through all levels of their
    cache hierarchies. IBM Power processors are a notable exception to this rule,
    which has 128-byte cache lines. Thus it's only useful for small data types.
+   For strings, see cashew_string_set.h.
  
 
    Data layout
@@ -19,7 +20,9 @@
    Each node is exactly 64-bytes long, and we try to fit as much as possible in
    it. The layout accommodates both 32-bit and 64-bit pointers. For example, if
    we are storing int32_t, each node has 14 or 13 elements. See
-   CashewSetTraits::elt_count_max below.
+   CashewSetTraits::elt_count_max below. With CashewSetTraits<Elt,true>, 64-bit
+   hosts get the 32-bit layout too, since families are then named by a 32-bit
+   offset into one big arena (see compact_unique.h).
 
    Only a single pointer is stored to make room for more data elements. In
    general, a node with node.elt_count() elements have node.elt_count()+1
@@ -32,6 +35,12 @@
      * Non-leaf node: 0 <= node.elt_count() <= elt_count_max &&
                       node.family != nullptr
 
+   With Traits::wide_leaves, leaves at the bottom level (depth == treeDepth)
+   can go up to leaf_elt_count_max instead, keeping the extra elements in the
+   bytes of node.family. Such nodes are recognized by elt_count() alone, so
+   code that may be looking at a leaf asks node.hasFamily() instead of
+   reading node.family.
+
    17th Dec. 2017: Hmm, I just allowed discontiguous data population in trees,
      where it is possible to have a chain of nodes with no elements. Inserted
      nodes get added to the leaf at the bottom of that chain. I don't feel too
@@ -43,12 +52,22 @@
      value.  Inserted values can be smaller or larger than all other values in
      the node.
 
+   Erasing an element never needs to restore any of this: a node can be left
+   with as few elements as it likes. We still merge underfull siblings on the
+   way back up, and free families that hold nothing, just so memory usage goes
+   down after erase(). This also means a non-leaf node can end up with
+   node.family == nullptr, if all of its children were empty.
+
    The node.family pointer always points to an array of
    node_type[elt_count_max+1]; Depending on node.elt_count(), the last few
    elements of this array may be unused: we always keep them zero-initialized
    anyway.
 
    Elements in a single node are not sorted, linear search seems good enough.
+   Unless Traits::sorted_within_node is set: then each node keeps its elts()
+   sorted, which makes inserts shift elements around, but allows a binary
+   search in each node. That helps with expensive comparisons, or larger
+   nodes.
    However, if we don't find an element at a node, we still need to figure out
    which child to proceed to. We determine this by computing the position it
    would have taken, had the elements in the node been sorted. So when looking
@@ -67,41 +86,87 @@
    have to be more generic than what we thought. Right now, we are using
    unique_ptr.
 
-   Maps will need a trailing array of values, but that needs flexibility in the
-   children layout described. We may need something special for root node, to
-   preserve index locality.
+   Maps (see cashew_map.h) keep their values out of line: each node gets a few
+   extra cache lines in front of its keys, where values are kept in the same
+   order as elts(). Nodes in a family are then no longer 64 bytes apart, but
+   the search path still only touches a single line of keys per level.
  */
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <stdexcept>
 #include <type_traits>
+#include <vector>
 
 #include "aligned_unique.h"
+#include "cashew_huge_pages.h"
+#include "cashew_node_search.h"
+#include "compact_unique.h"
+#include "slab_unique.h"
 
 namespace cashew {
 
 static_assert(sizeof(void*)==4 || sizeof(void*)==8,
     "CashewSet currently only supports 32-bit or 64-bit pointers");
 
-template <class Elt>
+// compact_refs picks a node layout where the family pointer only takes 32
+// bits, leaving room for more elements on 64-bit hosts: 14 int32_t instead of
+// 13, or 7 int64_t instead of 6. Families then have to live in CashewArena
+// (see compact_unique.h), which holds up to 256 GB for the whole process. It
+// is a template parameter, not an overridable member, since elt_count_max
+// depends on it.
+template <class Elt, bool compact_refs = false>
 struct CashewSetTraits {
   // Hardcoded things.
   using key_type=Elt;
   using elt_count_type=int8_t;
   static constexpr int cache_line_nbytes = 64;
+  // If true, each family also remembers how many elements are in the subtree
+  // under each child. This enables rank() and select(), at the cost of
+  // larger families and a little extra work on every insert and erase. Nodes
+  // stay the same size either way.
+  static constexpr bool track_subtree_counts = false;
+  // Number of lookups count_batch() keeps in flight at once. Each one has a
+  // node prefetch outstanding while we work on the others, so this should
+  // roughly match how many cache misses the CPU can wait on in parallel.
+  static constexpr int lookups_in_flight = 16;
+  // If true, node searches that don't have a vector kernel scan all
+  // elt_count_max slots without branching, instead of stopping at the first
+  // match. This tends to win for random keys and cheap comparisons. Keys
+  // have to be trivially copyable. See CashewBranchlessSearch.
+  static constexpr bool branchless_node_search = false;
+  // If true, each node keeps elts() sorted. Node searches without a vector
+  // kernel then use a binary search, and iterators don't have to sort nodes.
+  // Inserts and erases pay for this by shifting elements within a node.
+  static constexpr bool sorted_within_node = false;
+  // If true, families are allocated from 2 MB huge pages, so that lookups in
+  // big sets miss the TLB less often. Memory is taken 2 MB at a time. See
+  // cashew_huge_pages.h, and cashew_huge_page_stats() to check that the
+  // kernel went along with it. Only affects the default allocator.
+  static constexpr bool huge_page_nodes = false;
+  // If true, leaves keep extra elements in the bytes where other nodes keep
+  // their family pointer, since leaves never have children: 15 int32_t
+  // instead of 13, or 7 int64_t instead of 6. Leaves are most of the tree, so
+  // big sets take fewer lines. Can't be combined with sorted_within_node yet.
+  static constexpr bool wide_leaves = false;
 
   // Computed things.
+  static constexpr bool compact_family_refs = compact_refs;
+  static constexpr size_t family_ref_nbytes =
+    compact_refs ? sizeof(uint32_t) : sizeof(void*);
  private:
   static constexpr size_t elt_count_max_size_t = 
-    (cache_line_nbytes-sizeof(void*)-sizeof(elt_count_type)) / sizeof(Elt);
+    (cache_line_nbytes-family_ref_nbytes-sizeof(elt_count_type)) / sizeof(Elt);
  public:
   static_assert(std::numeric_limits<elt_count_type>::max() >=
                 elt_count_max_size_t+1,
@@ -111,41 +176,197 @@ struct CashewSetTraits {
   static constexpr elt_count_type children_per_node = elt_count_max+1;
 };
 
+// Most elements a leaf can hold. See wide_leaves. This lives outside of
+// CashewSetTraits, since computed members there can't see what derived
+// traits override.
+template <class Traits>
+struct CashewLeafCapacity : std::integral_constant<
+    typename Traits::elt_count_type, typename Traits::elt_count_type(
+      Traits::wide_leaves
+      ? Traits::elt_count_max
+        + Traits::family_ref_nbytes/sizeof(typename Traits::key_type)
+      : Traits::elt_count_max)> {};
+
+// Extra bookkeeping kept in each family, next to the child nodes. This empty
+// version is used by default, and takes no space as a base class.
+template <class Traits, bool enabled = Traits::track_subtree_counts>
+struct CashewFamilyCounts {
+  size_t subtreeCount(size_t) const { return 0; }
+  void setSubtreeCount(size_t, size_t) {}
+};
+
+// Number of elements under each child. Padded to a whole number of cache
+// lines, so the child nodes that come after it stay aligned. The padding has
+// to be explicit: derived classes may reuse tail padding.
+template <class Traits>
+struct CashewFamilyCounts<Traits,true> {
+  size_t subtreeCount(size_t i) const { return count_[i]; }
+  void setSubtreeCount(size_t i, size_t n) { count_[i]=n; }
+ private:
+  static constexpr size_t line_nbytes = Traits::cache_line_nbytes;
+  static constexpr size_t padded_count =
+    (Traits::children_per_node*sizeof(size_t)+line_nbytes-1)
+    / line_nbytes * line_nbytes / sizeof(size_t);
+  alignas(line_nbytes) size_t count_[padded_count];
+};
+
+// Where the default allocator gets its memory from. See huge_page_nodes and
+// compact_refs.
+template <class Traits>
+using CashewFamilyChunks = typename std::conditional<
+      Traits::compact_family_refs,CashewArenaChunks,
+      typename std::conditional<Traits::huge_page_nodes,
+        CashewHugePageChunks,CashewAlignedChunks>::type>::type;
+
+template <class Elt, class Traits>
+using CashewDefaultAllocator =
+  cashew_slab_allocator<Elt,CashewFamilyChunks<Traits>>;
+
+// Each family keeps a copy of the allocator it came from, so that it can be
+// freed without going through the set. Stateless allocators, like the
+// default one, are just default-constructed again instead, and take no
+// space as a base class.
+template <class FamilyAlloc, class Traits,
+          bool stateless = std::is_empty<FamilyAlloc>::value>
+struct CashewFamilyAllocator {
+  explicit CashewFamilyAllocator(const FamilyAlloc&) noexcept {}
+  FamilyAlloc allocator() const noexcept { return FamilyAlloc(); }
+};
+
+// Takes up a whole number of cache lines, for the same reason as
+// CashewFamilyCounts. Stateful allocators thus cost an extra line per family.
+template <class FamilyAlloc, class Traits>
+struct CashewFamilyAllocator<FamilyAlloc,Traits,false> {
+  explicit CashewFamilyAllocator(const FamilyAlloc& a) noexcept {
+    new (alloc_buf_) FamilyAlloc(a);
+  }
+  ~CashewFamilyAllocator() { alloc().~FamilyAlloc(); }
+  FamilyAlloc allocator() const noexcept { return alloc(); }
+ private:
+  static constexpr size_t line_nbytes = Traits::cache_line_nbytes;
+  alignas(line_nbytes) char alloc_buf_[
+    (sizeof(FamilyAlloc)+line_nbytes-1)/line_nbytes*line_nbytes];
+  const FamilyAlloc& alloc() const {
+    return *reinterpret_cast<const FamilyAlloc*>(alloc_buf_);
+  }
+  FamilyAlloc& alloc() { return *reinterpret_cast<FamilyAlloc*>(alloc_buf_); }
+};
+
+// Hints that *p will be read soon. A no-op on compilers we don't know.
+inline void prefetch_line(const void* p) {
+#if defined(__GNUC__)
+  __builtin_prefetch(p);
+#else
+  (void)p;
+#endif
+}
+
 template <class X> void placement_move(X& a,X& b) {
   new (&a) X(std::move(b));
 }
 
-// No-op if st>=en. Like new Type[], on exception it destroys the elements
-// that were created successfully.
-template <class X, class IntType>
-void placement_move_range(X* dest, X* src, IntType st, IntType en) {
-  IntType i;
-  try {
-    for(i=st;i<en;++i) placement_move(dest[i],src[i]);
-  } catch(...) {
-    for(IntType j=st;j<i;++j) dest[i].~X();
-    throw;
+// Storage for the values of a map, laid out as whole cache lines in front of
+// each node's line of keys. Searches only ever touch the keys. Sets use the
+// empty specialization below, which takes no space as a base class.
+//
+// Values are required to have non-throwing moves, so that keys and values
+// never get out of step while elements are being moved around.
+template <class Mapped, class Traits>
+class CashewNodeValues {
+  static constexpr size_t line_nbytes = Traits::cache_line_nbytes;
+ public:
+  static constexpr size_t nbytes =
+    (CashewLeafCapacity<Traits>::value*sizeof(Mapped)+line_nbytes-1)
+    / line_nbytes * line_nbytes;
+  Mapped& value(size_t i) { return reinterpret_cast<Mapped*>(value_buf_)[i]; }
+  const Mapped& value(size_t i) const {
+    return reinterpret_cast<const Mapped*>(value_buf_)[i];
   }
-}
+ protected:
+  CashewNodeValues() {
+    static_assert(std::is_nothrow_move_constructible<Mapped>::value &&
+                  std::is_nothrow_move_assignable<Mapped>::value,
+        "Mapped values need non-throwing move operations");
+  }
+  template <class... Args> void constructValue(size_t i, Args&&... args) {
+    new (&value(i)) Mapped(std::forward<Args>(args)...);
+  }
+  void moveConstructValue(size_t i, CashewNodeValues& that, size_t j) {
+    new (&value(i)) Mapped(std::move(that.value(j)));
+  }
+  void moveAssignValue(size_t i, CashewNodeValues& that, size_t j) {
+    value(i)=std::move(that.value(j));
+  }
+  void destroyValue(size_t i) { value(i).~Mapped(); }
+  // Rotates value(i..j) right by one, so value(j) ends up at i.
+  void rotateValues(size_t i, size_t j) {
+    Mapped* v = &value(0);
+    std::rotate(v+i,v+j,v+j+1);
+  }
+ private:
+  alignas(line_nbytes) char value_buf_[nbytes];
+};
 
+template <class Traits>
+class CashewNodeValues<void,Traits> {
+ public:
+  static constexpr size_t nbytes = 0;
+ protected:
+  template <class... Args> void constructValue(size_t, Args&&...) {}
+  void moveConstructValue(size_t, CashewNodeValues&, size_t) {}
+  void moveAssignValue(size_t, CashewNodeValues&, size_t) {}
+  void destroyValue(size_t) {}
+  void rotateValues(size_t, size_t) {}
+};
 
 // Stores a vector of keys as elts(), and a unique_ptr to an array of other
-// node objects.
-template <class Elt, class Traits>
-class CashewSetNode {
+// node objects. If Mapped is not void, each element also has a value(i),
+// stored out of line in the bytes just before the keys. With
+// Traits::wide_leaves, a leaf can grow past elt_count_max into the bytes of
+// family, as long as family is nullptr when it does.
+template <class Elt, class Traits, class Mapped = void,
+          class Alloc = CashewDefaultAllocator<Elt,Traits>>
+class CashewSetNode : public CashewNodeValues<Mapped,Traits> {
  public:
   using key_type = typename Traits::key_type;
+  using mapped_type = Mapped;
   using elt_count_type = typename Traits::elt_count_type;
   static constexpr elt_count_type elt_count_max = Traits::elt_count_max;
+  static constexpr elt_count_type leaf_elt_count_max =
+    CashewLeafCapacity<Traits>::value;
 
   // We don't directly use aligned_unique_ptr<T[]>, and instead wrap T[] in
   //   a struct. This is because (a) {aligned_,}unique_ptr<T[n]> is not defined
   //   for some unknown reason, and (b) T[] specializations use a bit more
   //   memory to track array length, so they can call destructors properly.
+  // Families come from Alloc, rebound to family_type. By default, that's a
+  // CashewSlab, since we allocate and free so many of them, all the same
+  // size.
   struct family_type;
-  using family_pointer_type = aligned_unique_ptr<family_type>;
+  using family_allocator = typename std::allocator_traits<Alloc>::template
+    rebind_alloc<family_type>;
+  struct family_deleter {
+    void operator()(family_type* p) const noexcept;
+  };
+  using family_pointer_type = typename std::conditional<
+    Traits::compact_family_refs,
+    compact_unique_ptr<family_type,family_deleter>,
+    std::unique_ptr<family_type,family_deleter>>::type;
+  // Not to be read directly from a node that might be a leaf: in wide leaves,
+  // these bytes hold elements. See hasFamily().
   family_pointer_type family;
   elt_count_type elt_count() const { return elt_count_; }
+  // True if elements have spilled into the bytes of family. Only leaves with
+  // more than elt_count_max elements do that, with Traits::wide_leaves.
+  bool familyHoldsElts() const {
+    return Traits::wide_leaves && elt_count_>elt_count_max;
+  }
+  // Picks rather than branches, since how full a leaf is can't be predicted.
+  bool hasFamily() const {
+    if(!Traits::wide_leaves) return family!=nullptr;
+    const uintptr_t p = reinterpret_cast<uintptr_t>(family.get());
+    return (p & -uintptr_t(elt_count_<=elt_count_max))!=0;
+  }
  private:
   // Indicates that elt([0..elt_count_)] are valid objects. For lifecycle
   // management, it indicates how many destructors calls we are responsible for.
@@ -155,31 +376,85 @@ class CashewSetNode {
   // We should really have declared it simply, without requiring these getters:
   //   Elt elts[elt_count_max];
   alignas(Elt) char elt_buf_[elt_count_max*sizeof(Elt)];
+
+  using values_type = CashewNodeValues<Mapped,Traits>;
+  // Element-wise helpers that keep values in step with keys. Values never
+  // throw on moves, so keys are always moved first.
+  void moveConstructElt(elt_count_type i, CashewSetNode& that,
+                        elt_count_type j) {
+    placement_move(elt(i),that.elt(j));
+    this->moveConstructValue(i,that,j);
+  }
+  void moveAssignElt(elt_count_type i, CashewSetNode& that, elt_count_type j) {
+    if(this==&that && i==j) return;
+    elt(i)=std::move(that.elt(j));
+    this->moveAssignValue(i,that,j);
+  }
+  void destroyElt(elt_count_type i) {
+    elt(i).~Elt();
+    this->destroyValue(i);
+  }
+  // Brings family back to life as nullptr, once a wide leaf has shrunk back
+  // to elt_count_max elements. old_count is what elt_count_ used to be.
+  void reclaimFamily(elt_count_type old_count) noexcept {
+    if(Traits::wide_leaves && old_count>elt_count_max &&
+       elt_count_<=elt_count_max)
+      new (&family) family_pointer_type(nullptr);
+  }
  public:
-  Elt& elt(size_t i) { return reinterpret_cast<Elt*>(elt_buf_)[i]; }
+  // Elements past elt_count_max, which only wide leaves have, live where
+  // family would be.
+  Elt& elt(size_t i) {
+    if(Traits::wide_leaves && i>=size_t(elt_count_max))
+      return reinterpret_cast<Elt*>(&family)[i-elt_count_max];
+    return reinterpret_cast<Elt*>(elt_buf_)[i];
+  }
   const Elt& elt(size_t i) const {
+    if(Traits::wide_leaves && i>=size_t(elt_count_max))
+      return reinterpret_cast<const Elt*>(&family)[i-elt_count_max];
     return reinterpret_cast<const Elt*>(elt_buf_)[i];
   }
   Elt* elts() { return reinterpret_cast<Elt*>(elt_buf_); }
 
   CashewSetNode() : family(nullptr), elt_count_(0) {
-    static_assert(sizeof(CashewSetNode) == Traits::cache_line_nbytes,
+    // Branchless searches compare unused slots too. Give them something
+    // defined to look at.
+    if(Traits::branchless_node_search)
+      std::memset(elt_buf_,0,sizeof(elt_buf_));
+    static_assert(sizeof(CashewSetNode) ==
+        Traits::cache_line_nbytes+values_type::nbytes,
         "Tree nodes do not match cache size");
     // This requirement simplifies exception safety.
     static_assert(std::is_trivial<elt_count_type>::value,
         "Internal type elt_count_type must be trivial");
+    // Compact refs can only point into CashewArena.
+    static_assert(!Traits::compact_family_refs || std::is_same<family_allocator,
+        cashew_slab_allocator<family_type,CashewArenaChunks>>::value,
+        "compact_refs needs the default allocator");
+    static_assert(!Traits::compact_family_refs || !Traits::huge_page_nodes,
+        "compact_refs and huge_page_nodes can't be used together yet");
+    static_assert(Traits::cache_line_nbytes%CashewArena::unit_nbytes==0 ||
+        !Traits::compact_family_refs, "Families don't fit arena units");
+    // Binary searches and rotations need elts() to be contiguous.
+    static_assert(!Traits::wide_leaves || !Traits::sorted_within_node,
+        "wide_leaves and sorted_within_node can't be used together yet");
   }
   CashewSetNode(const CashewSetNode&) = delete;
   ~CashewSetNode() {
-    for(elt_count_type i=0;i<elt_count_;++i) elt(i).~Elt();
+    const elt_count_type old_count = elt_count_;
+    for(elt_count_type i=0;i<elt_count_;++i) destroyElt(i);
+    elt_count_=0;
+    reclaimFamily(old_count);
   }
   CashewSetNode& operator=(const CashewSetNode&) = delete;
   // Provides basic exception safety: nothing leaks.
   CashewSetNode& operator=(CashewSetNode&& that);
 
   void clear() noexcept {
-    for(elt_count_type i=0;i<elt_count_;++i) elt(i).~Elt();
+    const elt_count_type old_count = elt_count_;
+    for(elt_count_type i=0;i<elt_count_;++i) destroyElt(i);
     elt_count_=0;
+    reclaimFamily(old_count);
     family.reset();
   }
   // Split elts() between left and right, with elts smaller than p going left,
@@ -188,47 +463,114 @@ class CashewSetNode {
   // also assumes left and right start with elt_count==0.
   // Provides basic exception safety: nothing is leaked.
   template <class Less>
-    void splitElts(CashewSetNode& left,CashewSetNode& right,Elt p,Less less);
+    void splitElts(CashewSetNode& left,CashewSetNode& right,const Elt& p,
+                   Less less);
   // Split elts() between *this and that, with elts smaller than p remaining
   // in *this. Assumes no elt is exactly equal to p.
   // Does not touch family, which should be rearranged as well.
   // Provides basic exception safety: nothing is leaked.
   template <class Less>
-    void splitEltsInto(CashewSetNode& that, Elt p, Less less);
-  // Does not touch family, whish should be rearranged as well.
-  void addElt(Elt key) { new (&elt(elt_count_)) Elt(key); elt_count_++; }
+    void splitEltsInto(CashewSetNode& that, const Elt& p, Less less);
+  // Does not touch family, whish should be rearranged as well. For maps, args
+  // are used to construct the new value. Moves key in if it's an rvalue.
+  template <class K, class... Args> void addElt(K&& key, Args&&... args) {
+    this->constructValue(elt_count_,std::forward<Args>(args)...);
+    try {
+      new (&elt(elt_count_)) Elt(std::forward<K>(key));
+    }catch(...) {
+      this->destroyValue(elt_count_);
+      throw;
+    }
+    elt_count_++;
+  }
+  // Moves the last element to position i, shifting the ones after it, if
+  // elements are kept sorted. Returns where the last element ended up.
+  elt_count_type moveLastTo(elt_count_type i) {
+    const elt_count_type last = elt_count_-1;
+    if(!Traits::sorted_within_node || i==last) return last;
+    std::rotate(elts()+i,elts()+last,elts()+last+1);
+    this->rotateValues(i,last);
+    return i;
+  }
+  // Appends that.elt(j), along with its value. Leaves that.elt(j) in a
+  // moved-from state, for the caller to remove. Does not touch family.
+  void moveEltFrom(CashewSetNode& that, elt_count_type j) {
+    moveConstructElt(elt_count_,that,j);
+    elt_count_++;
+  }
+  // Overwrites elt(i) with that.elt(j), along with its value. Leaves
+  // that.elt(j) in a moved-from state, for the caller to remove.
+  void replaceElt(elt_count_type i, CashewSetNode& that, elt_count_type j) {
+    moveAssignElt(i,that,j);
+  }
+  // Removes elt(i) by moving the last element into its place. If elements
+  // are kept sorted, the ones after i shift down instead. Does not touch
+  // family.
+  void removeElt(elt_count_type i) {
+    if(Traits::sorted_within_node)
+      for(;i+1<elt_count_;++i) moveAssignElt(i,*this,i+1);
+    else if(i+1<elt_count_) moveAssignElt(i,*this,elt_count_-1);
+    destroyElt(--elt_count_);
+    reclaimFamily(elt_count_+1);
+  }
+  // Moves all of that.elts() to the end of elts(), leaving that with no
+  // elements. Assumes they fit. Does not touch family.
+  // Provides basic exception safety: nothing is leaked.
+  void appendElts(CashewSetNode& that);
 };
 
-template <class Elt, class Traits>
-struct CashewSetNode<Elt, Traits>::family_type {
+// Aligned to a cache line, so that allocators which honour alignof() keep
+// every child node on its own line.
+template <class Elt, class Traits, class Mapped, class Alloc>
+struct alignas(Traits::cache_line_nbytes)
+    CashewSetNode<Elt, Traits, Mapped, Alloc>::family_type
+    : CashewFamilyCounts<Traits>,
+      CashewFamilyAllocator<family_allocator,Traits> {
+  explicit family_type(const family_allocator& a)
+    : CashewFamilyAllocator<family_allocator,Traits>(a) {}
   CashewSetNode child[elt_count_max+1];
 };
 
-template <class Elt, class Traits>
-CashewSetNode<Elt,Traits>&
-CashewSetNode<Elt,Traits>::operator=(CashewSetNode<Elt,Traits>&& that) {
+template <class Elt, class Traits, class Mapped, class Alloc>
+void CashewSetNode<Elt,Traits,Mapped,Alloc>::family_deleter::operator()(
+    family_type* p) const noexcept {
+  family_allocator a = p->allocator();
+  p->~family_type();
+  std::allocator_traits<family_allocator>::deallocate(a,p,1);
+}
+
+template <class Elt, class Traits, class Mapped, class Alloc>
+CashewSetNode<Elt,Traits,Mapped,Alloc>&
+CashewSetNode<Elt,Traits,Mapped,Alloc>::operator=(
+    CashewSetNode<Elt,Traits,Mapped,Alloc>&& that) {
   if (this==&that) return *this;
+  // Starting from empty keeps family valid while elements move in, in case
+  // one side is a wide leaf.
+  this->clear();
   elt_count_type i;
-  elt_count_type min_count=std::min(this->elt_count_,that.elt_count_);
-  for(i=0;i<min_count;++i) this->elt(i)=std::move(that.elt(i));
-  placement_move_range(this->elts(),that.elts(),min_count,that.elt_count_);
-  for(;i<this->elt_count_;++i) this->elt(i).~Elt();
+  try {
+    for(i=0;i<that.elt_count_;++i) this->moveConstructElt(i,that,i);
+  }catch(...) {
+    this->elt_count_=i;
+    throw;
+  }
   this->elt_count_=that.elt_count_;
-  this->family=std::move(that.family);
+  if(!that.familyHoldsElts()) this->family=std::move(that.family);
   that.clear();
   return *this;
 }
 
-template <class Elt, class Traits>
+template <class Elt, class Traits, class Mapped, class Alloc>
 template <class Less>
-void CashewSetNode<Elt,Traits>::splitElts(
-    CashewSetNode<Elt,Traits>& left, CashewSetNode<Elt,Traits>& right,
-    Elt p, Less less) {
+void CashewSetNode<Elt,Traits,Mapped,Alloc>::splitElts(
+    CashewSetNode<Elt,Traits,Mapped,Alloc>& left,
+    CashewSetNode<Elt,Traits,Mapped,Alloc>& right,
+    const Elt& p, Less less) {
   elt_count_type i,j=0;
   try {
     for(i=0;i<this->elt_count_;++i) {
-      if(less(this->elt(i),p)) placement_move(left.elt(i-j),this->elt(i));
-      else { placement_move(right.elt(j),this->elt(i)); j++; }
+      if(less(this->elt(i),p)) left.moveConstructElt(i-j,*this,i);
+      else { right.moveConstructElt(j,*this,i); j++; }
     }
   }catch(...) {
     left.elt_count_=i-j;
@@ -237,21 +579,23 @@ void CashewSetNode<Elt,Traits>::splitElts(
   }
   left.elt_count_=i-j;
   right.elt_count_=j;
-  for(i=0;i<this->elt_count_;++i) this->elt(i).~Elt();
+  const elt_count_type old_count=this->elt_count_;
+  for(i=0;i<this->elt_count_;++i) this->destroyElt(i);
   this->elt_count_=0;
+  this->reclaimFamily(old_count);
 }
 
-template <class Elt, class Traits>
+template <class Elt, class Traits, class Mapped, class Alloc>
 template <class Less>
-void CashewSetNode<Elt,Traits>::splitEltsInto(
-    CashewSetNode<Elt,Traits>& that, Elt p, Less less) {
+void CashewSetNode<Elt,Traits,Mapped,Alloc>::splitEltsInto(
+    CashewSetNode<Elt,Traits,Mapped,Alloc>& that, const Elt& p, Less less) {
   elt_count_type i,j=0,new_that_count,new_this_count;
   try {
     for(i=0;i<this->elt_count_;++i)
-      if(less(this->elt(i),p)) this->elt(i-j)=std::move(this->elt(i));
-      else if(j<that.elt_count_) that.elt(j++)=std::move(this->elt(i)); 
+      if(less(this->elt(i),p)) this->moveAssignElt(i-j,*this,i);
+      else if(j<that.elt_count_) that.moveAssignElt(j++,*this,i);
       else {
-        placement_move(that.elt(j), this->elt(i));
+        that.moveConstructElt(j,*this,i);
         j++;
       }
   }catch(...) {
@@ -260,249 +604,1244 @@ void CashewSetNode<Elt,Traits>::splitEltsInto(
   }
   new_that_count=j;
   new_this_count=this->elt_count_-j;
-  for(;j<that.elt_count_;++j) that.elt(j).~Elt();
-  for(i=new_this_count;i<this->elt_count_;++i) this->elt(i).~Elt();
+  const elt_count_type old_this_count=this->elt_count_;
+  const elt_count_type old_that_count=that.elt_count_;
+  for(;j<that.elt_count_;++j) that.destroyElt(j);
+  for(i=new_this_count;i<this->elt_count_;++i) this->destroyElt(i);
   this->elt_count_=new_this_count;
   that.elt_count_=new_that_count;
+  this->reclaimFamily(old_this_count);
+  that.reclaimFamily(old_that_count);
+}
+
+template <class Elt, class Traits, class Mapped, class Alloc>
+void CashewSetNode<Elt,Traits,Mapped,Alloc>::appendElts(
+    CashewSetNode<Elt,Traits,Mapped,Alloc>& that) {
+  elt_count_type i;
+  try {
+    for(i=0;i<that.elt_count_;++i)
+      this->moveConstructElt(this->elt_count_+i,that,i);
+  }catch(...) {
+    this->elt_count_+=i;
+    throw;
+  }
+  this->elt_count_+=that.elt_count_;
+  const elt_count_type old_count=that.elt_count_;
+  for(i=0;i<that.elt_count_;++i) that.destroyElt(i);
+  that.elt_count_=0;
+  that.reclaimFamily(old_count);
 }
 
 struct cashew_set_bug : std::logic_error {
   explicit cashew_set_bug(const char* what) : std::logic_error(what) {}
 };
 
+template <class Key, class T, class Less, class Eq, class Traits, class Alloc>
+class cashew_map;
+
+template <class...> struct cashew_void { using type = void; };
+
+// Has a member type, if both Less and Eq can compare elements with keys of
+// other types, as std::less<> and std::equal_to<> can. Depends on K only so
+// that member templates can use it to drop out of overload resolution.
+template <class Less, class Eq, class K, class = void>
+struct cashew_transparent_key {};
+
+template <class Less, class Eq, class K>
+struct cashew_transparent_key<Less,Eq,K,typename cashew_void<
+    typename Less::is_transparent,typename Eq::is_transparent>::type> {
+  using type = K;
+};
+template <class Less, class Eq, class K> using cashew_if_transparent =
+  typename cashew_transparent_key<Less,Eq,K>::type;
+
 // Comparisons are assumed cheap. The same two elements may be compared
 // repeatedly to each other.
+//
+// Alloc is a standard allocator, which gets rebound to allocate whole
+// families. It has to honour alignof(), like std::pmr::polymorphic_allocator
+// and (in C++17) std::allocator do. Sets can't be copied or moved, so its
+// propagate_on_* traits don't matter.
+//
+// Mapped is for use by cashew_map, which keeps a value next to each element.
+// Sets should leave it as void.
 template <class Elt, class Less = std::less<Elt>,
           class Eq = std::equal_to<Elt>,
-          class Traits = CashewSetTraits<Elt>>
+          class Traits = CashewSetTraits<Elt>,
+          class Alloc = CashewDefaultAllocator<Elt,Traits>,
+          class Mapped = void>
 class cashew_set {
  public:
   using key_type = typename Traits::key_type;
   using value_type = typename Traits::key_type;
   using size_type = size_t;
-  bool insert(key_type key);
+  using allocator_type = Alloc;
+  cashew_set() = default;
+  explicit cashew_set(const Alloc& a) : alloc(a) {}
+  // For comparators with state, like those of cashew_string_set.
+  explicit cashew_set(const Less& less, const Eq& eq = Eq(),
+                      const Alloc& a = Alloc())
+      : less(less), eq(eq), alloc(a) {}
+  allocator_type get_allocator() const { return allocator_type(alloc); }
+  bool insert(const key_type& key) { return emplaceKey(key).second; }
+  bool insert(key_type&& key) { return emplaceKey(std::move(key)).second; }
+  // Builds an element from args, and moves it into the set if it's new.
+  // Returns whether it was.
+  template <class... Args> bool emplace(Args&&... args) {
+    return emplaceKey(key_type(std::forward<Args>(args)...)).second;
+  }
+  // Returns the number of elements removed: 0 or 1. Takes key by value, since
+  // it may be one of our own elements, which erasing moves around.
+  size_type erase(key_type key) { return eraseKey(key); }
+  // With transparent comparators, also takes anything they can compare with
+  // elements. See count() below.
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  size_type erase(const K& key) { return eraseKey(key); }
   void clear() noexcept {
     root.clear();
     treeDepth = 1;
     treeEltCount = 0;
   }
-  size_type count(key_type key) const { return countRecursive(root,key); }
+  // Replaces the contents with [first,last), which must be sorted and free of
+  // duplicates. The tree is built bottom-up, with every node holding
+  // fill*elt_count_max elements (fill*leaf_elt_count_max for leaves), except
+  // for a few near the right edge. A fill below 1 leaves room in each node
+  // for later inserts. Throws
+  // std::invalid_argument, leaving the set empty, if the input is not sorted.
+  template <class ForwardIt>
+    void assign_sorted(ForwardIt first, ForwardIt last, double fill = 1.0);
+  // Inserts every key in [first,last), which need not be sorted, and returns
+  // how many of them were new. The batch is sorted first, and then merged in
+  // with one walk down the tree, which only goes back up as far as the next
+  // key needs. Batches at least as big as the set rebuild it instead, which
+  // briefly takes room for a second copy of both. If inserted is not null, it
+  // is resized to the length of the batch, and marks the keys that were new.
+  // Of several equal keys in the batch, only the first one counts as new.
+  template <class InputIt> size_type insert_batch(
+      InputIt first, InputIt last, std::vector<bool>* inserted = nullptr);
+  size_type count(const key_type& key) const {
+    return countRecursive(root,key);
+  }
+  // With transparent comparators, like std::less<> and std::equal_to<>, the
+  // lookups below also take anything the comparators can compare with
+  // elements, without turning it into a key_type first.
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  size_type count(const K& key) const { return countRecursive(root,key); }
+  // Sets out[i] to count(keys[i]), for each i<n. Returns the sum of out[]. A
+  // few lookups walk down the tree interleaved with each other, prefetching
+  // the next node of each one, so their cache misses overlap.
+  size_type count_batch(const key_type* keys, size_type n,
+                        size_type* out) const;
   size_type size() const noexcept { return treeEltCount; }
   bool empty() const noexcept { return treeEltCount==0; }
+
+  // Bidirectional iterators, visiting elements in sorted order. Elements move
+  // between nodes whenever nodes split or merge, so any insert() or erase()
+  // invalidates all iterators.
+  class const_iterator;
+  using iterator = const_iterator;
+  const_iterator begin() const { return seek<key_type>(nullptr,true); }
+  const_iterator end() const { return const_iterator(this); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  const_iterator find(const key_type& key) const { return findKey(key); }
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  const_iterator find(const K& key) const { return findKey(key); }
+  // First element not less than key.
+  const_iterator lower_bound(const key_type& key) const {
+    return seek(&key,true,true);
+  }
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  const_iterator lower_bound(const K& key) const {
+    return seek(&key,true,true);
+  }
+  // First element greater than key.
+  const_iterator upper_bound(const key_type& key) const {
+    return seek(&key,true,false);
+  }
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  const_iterator upper_bound(const K& key) const {
+    return seek(&key,true,false);
+  }
+  std::pair<const_iterator,const_iterator> equal_range(
+      const key_type& key) const {
+    return equalRange(key);
+  }
+  template <class K, class = cashew_if_transparent<Less,Eq,K>>
+  std::pair<const_iterator,const_iterator> equal_range(const K& key) const {
+    return equalRange(key);
+  }
+
+  // Order statistics. These need Traits::track_subtree_counts, and take
+  // O(depth) node visits.
+  // Number of elements less than key.
+  size_type rank(const key_type& key) const;
+  // The i-th smallest element, counting from 0. Returns end() if i>=size().
+  const_iterator select(size_type i) const;
+  // Number of elements in [lo, hi).
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return less(lo,hi)?rank(hi)-rank(lo):0;
+  }
  private:
   using depth_type = int8_t;  // One byte is *plenty*.
   using elt_count_type = typename Traits::elt_count_type;
-  using node_type = CashewSetNode<Elt,Traits>;
-  using family_type = typename CashewSetNode<Elt,Traits>::family_type;
+  using node_type = CashewSetNode<Elt,Traits,Mapped,Alloc>;
+  using family_type = typename node_type::family_type;
+  template <class, class, class, class, class, class> friend class cashew_map;
   node_type root;
   Less less;
   Eq eq;
+  typename node_type::family_allocator alloc;
   depth_type treeDepth = 1;      // We start counting at root depth == 1.
   size_type treeEltCount = 0;
 
+  // Index of key in node, or -1. See CashewNodeSearch.
+  template <class Key>
+  elt_count_type findInNode(const node_type& node, const Key& key,
+                            elt_count_type& lessCount) const {
+    return CashewNodeSearch<Elt,Less,Eq,Traits>::find(
+        node,key,less,eq,lessCount);
+  }
   void checkBugs(const node_type& node, depth_type nodeDepth) const;
-  int countRecursive(const node_type& node, key_type key) const;
-
-  // Insert method helpers.
-  enum class InsStatus : char {done, duplicateFound, familySplit};
-  struct TryInsertResult {
-    // Note to future self: I could have saved a few cycles in
-    // insertSpacious if we were to return only one of these,
-    // since family0 doesn't really change.
-    aligned_unique_ptr<family_type> family0, family1;
-    InsStatus status;
+  // Most elements a node at nodeDepth can hold. Leaves may hold more, if
+  // Traits::wide_leaves is set.
+  elt_count_type nodeCapacity(depth_type nodeDepth) const {
+    return nodeDepth==treeDepth?node_type::leaf_elt_count_max
+                               :node_type::elt_count_max;
+  }
+  template <class Key>
+    int countRecursive(const node_type& node, const Key& key) const;
+
+  // Lookup helpers, for key_type and transparent keys alike.
+  template <class Key> const_iterator findKey(const Key& key) const;
+  template <class Key> std::pair<const_iterator,const_iterator> equalRange(
+      const Key& key) const {
+    const_iterator it=lower_bound(key);
+    if(it==end() || !eq(*it,key)) return {it,it};
+    const_iterator jt=it;
+    return {it,++jt};
+  }
+
+  // Iterator helpers.
+  template <class Key> const_iterator seek(const Key* key, bool forward,
+                                           bool inclusive=false) const;
+  const_iterator iteratorAt(const node_type* node, elt_count_type i) const;
+  void sortedOrder(const node_type& node, elt_count_type* order) const;
+
+  // Subtree count helpers. All of these are no-ops, unless
+  // Traits::track_subtree_counts is set.
+  static size_type subtreeSize(const node_type& node);
+  static void recountChild(node_type& node, elt_count_type c);
+  static void recountFamily(family_type& family);
+
+  // Insert method helpers. The args are only used to construct the mapped
+  // value for cashew_map, if the key turns out to be new.
+  struct EltRef {
+    node_type* node;
+    elt_count_type pos;
   };
-  TryInsertResult insertSpacious(
-      node_type& node,depth_type nodeDepth,key_type key,
-      elt_count_type lessCount);
-  TryInsertResult insertFull(
-      node_type& node,depth_type nodeDepth,key_type key,
-      elt_count_type lessCount);
-  TryInsertResult tryInsert(
-      node_type& node,depth_type nodeDepth,
-      key_type key);
-  static aligned_unique_ptr<family_type> make_family() {
-    auto rv = make_aligned_unique<family_type, Traits::cache_line_nbytes>();
-    if ((ptrdiff_t(rv->child) & (Traits::cache_line_nbytes-1)) != 0)
-      // This should be a warning, not an error. But right now,
-      // this indicates a GCC problem that causes memory corrption.
-      throw cashew_set_bug("new[] produced unaligned tree nodes. "
-          "This may have to be recompiled with --std=c++1z.");
-    return std::move(rv);
+  // key is either a const key_type& or a key_type&&. It gets passed down by
+  // reference, and only the addElt() that finally stores it moves from it.
+  template <class K, class... Args>
+    std::pair<EltRef,bool> emplaceKey(K&& key, Args&&... args);
+  using family_pointer = typename node_type::family_pointer_type;
+  // Enough for any depth_type.
+  static constexpr int max_tree_depth = std::numeric_limits<depth_type>::max();
+  // A node on the way down, and where key goes in it.
+  struct PathStep {
+    node_type* node;
+    elt_count_type lessCount;
+  };
+  template <class K, class... Args> EltRef placeKey(
+      const PathStep* path,depth_type spacious,K&& key,Args&&... args);
+  // The smallest element in node greater than key, or nullptr if there is
+  // none. lessCount is as findInNode() left it.
+  const Elt* successorIn(const node_type& node,const key_type& key,
+                         elt_count_type lessCount) const;
+  void splitFamily(node_type& node,elt_count_type lessCount,
+                   const key_type& key,family_pointer& family0,
+                   family_pointer& family1);
+  void absorbChildSplit(node_type& node,elt_count_type lessCount,
+                        const key_type& key,family_pointer& family0,
+                        family_pointer& family1);
+  static void adoptFamilies(node_type& lt_node,node_type& gt_node,
+                            family_pointer& family0,family_pointer& family1);
+  family_pointer make_family();
+
+  // Bulk load helper.
+  template <class ForwardIt> void buildSorted(
+      node_type& node,size_type n,size_type capacity,elt_count_type perNode,
+      elt_count_type perLeaf,ForwardIt& it,const Elt*& prev);
+
+  // Erase method helpers.
+  template <class Key> size_type eraseKey(const Key& key);
+  template <class Key> bool eraseRecursive(node_type& node,
+                                           depth_type nodeDepth,
+                                           const Key& key);
+  void eraseAt(node_type& node,depth_type nodeDepth,
+      elt_count_type i,elt_count_type rank);
+  void popMaxInto(node_type& node,depth_type nodeDepth,
+      node_type& dest,elt_count_type i);
+  void popMinInto(node_type& node,depth_type nodeDepth,
+      node_type& dest,elt_count_type i);
+  void rebalanceChild(node_type& node,depth_type nodeDepth,elt_count_type c);
+  void mergeChildren(node_type& node,elt_count_type c);
+  static void removeChild(node_type& node,elt_count_type c);
+  static void dropEmptyFamily(node_type& node);
+  static bool subtreeEmpty(const node_type& node);
+  elt_count_type indexOfRank(const node_type& node,elt_count_type rank) const;
+};
+
+// Since elements are not sorted within a node, the iterator sorts the indices
+// of a node's elements the first time it steps within that node. After that,
+// stepping through the node is just a matter of moving along order_. That is
+// only worth doing for nodes without children: for any other node, the next
+// element is down in some subtree, so we just search for it from the root.
+// That's one search per node visited, not per element. Iterators that are
+// never moved, like the ones find() returns, never sort anything. Neither do
+// iterators over nodes that are already sorted (Traits::sorted_within_node).
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+class cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::const_iterator {
+ public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename cashew_set::value_type;
+  using difference_type = ptrdiff_t;
+  using pointer = const value_type*;
+  using reference = const value_type&;
+
+  const_iterator() : set_(nullptr), node_(nullptr), cur_(0), pos_(-1) {}
+  reference operator*() const { return node_->elt(cur_); }
+  pointer operator->() const { return &**this; }
+  const_iterator& operator++() {
+    if(!node_->hasFamily() && rankedPos()+1<node_->elt_count())
+      cur_=order_[++pos_];
+    else *this=set_->seek(&**this,true);
+    return *this;
+  }
+  const_iterator& operator--() {
+    if(node_==nullptr) *this=set_->template seek<key_type>(nullptr,false);
+    else if(!node_->hasFamily() && rankedPos()>0) cur_=order_[--pos_];
+    else *this=set_->seek(&**this,false);
+    return *this;
   }
+  const_iterator operator++(int) { const_iterator rv=*this; ++*this; return rv; }
+  const_iterator operator--(int) { const_iterator rv=*this; --*this; return rv; }
+  bool operator==(const const_iterator& that) const {
+    return node_==that.node_ && cur_==that.cur_;
+  }
+  bool operator!=(const const_iterator& that) const { return !(*this==that); }
+
+ private:
+  friend class cashew_set;
+  template <class, class, class, class, class, class> friend class cashew_map;
+  explicit const_iterator(const cashew_set* set)
+    : set_(set), node_(nullptr), cur_(0), pos_(-1) {}
+  // Fills in order_ if we haven't done so yet, and returns pos_.
+  elt_count_type rankedPos() {
+    if(pos_<0) {
+      set_->sortedOrder(*node_,order_);
+      for(pos_=0;order_[pos_]!=cur_;++pos_);
+    }
+    return pos_;
+  }
+
+  const cashew_set* set_;
+  const node_type* node_;  // nullptr for end().
+  elt_count_type cur_;     // We are at node_->elt(cur_).
+  elt_count_type pos_;     // cur_==order_[pos_], or -1 if order_ is unset.
+  elt_count_type order_[node_type::leaf_elt_count_max];
 };
 
+// Finds the smallest element larger than *key if forward is true, otherwise
+// the largest element smaller than *key. If inclusive is true, an element
+// equal to *key is returned instead, if there is one. A null key acts as
+// -infinity when moving forward, and +infinity when moving backward. So
+// seek(nullptr,true) finds the smallest element.
+//
+// This is the same descent as countRecursive(), with behindCount playing the
+// role of lessCount. Any candidate found in a child subtree is closer to key
+// than the one found in its parent, so we just keep the last candidate we see
+// on the way down.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class Key>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::seek(
+    const Key* key, bool forward, bool inclusive) const
+    -> const_iterator {
+  const node_type* node = &root;
+  const node_type* bestNode = nullptr;
+  elt_count_type best = -1;
+  while(node!=nullptr) {
+    elt_count_type behindCount = 0, nodeBest = -1;
+    for(elt_count_type i=0;i<node->elt_count();++i) {
+      const Elt& e = node->elt(i);
+      if(inclusive && eq(e,*key)) return iteratorAt(node,i);
+      if(key!=nullptr && (forward?!less(*key,e):!less(e,*key))) {
+        behindCount++;
+        continue;
+      }
+      if(nodeBest<0 || (forward?less(e,node->elt(nodeBest))
+                               :less(node->elt(nodeBest),e)))
+        nodeBest = i;
+    }
+    if(nodeBest>=0) { bestNode = node; best = nodeBest; }
+    if(!node->hasFamily()) break;
+    node = &node->family->child[forward?behindCount
+                                       :node->elt_count()-behindCount];
+  }
+  return bestNode==nullptr?end():iteratorAt(bestNode,best);
+}
+
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class Key>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::findKey(
+    const Key& key) const -> const_iterator {
+  const node_type* node = &root;
+  while(true) {
+    elt_count_type lessCount;
+    const elt_count_type i = findInNode(*node,key,lessCount);
+    if(i>=0) return iteratorAt(node,i);
+    if(!node->hasFamily()) return end();
+    node = &node->family->child[lessCount];
+  }
+}
+
+// Returns an iterator pointing at node->elt(i).
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::iteratorAt(
+    const node_type* node, elt_count_type i) const -> const_iterator {
+  const_iterator rv(this);
+  rv.node_ = node;
+  rv.cur_ = i;
+  return rv;
+}
+
+// Fills order[] with indices of node.elts(), in sorted order of elements.
+// Insertion sort: nodes are small, and this doesn't call less() on the same
+// pair twice.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::sortedOrder(
+    const node_type& node, elt_count_type* order) const {
+  // Callers size order for the fullest leaf. Checking that here also lets
+  // the compiler bound the loops below.
+  const elt_count_type n = node.elt_count();
+  if(n>node_type::leaf_elt_count_max)
+    throw cashew_set_bug("Node is corrupted. Element count too large.");
+  if(Traits::sorted_within_node) {
+    for(elt_count_type j=0;j<n;++j) order[j]=j;
+    return;
+  }
+  for(elt_count_type j=0;j<n;++j) {
+    elt_count_type k=j;
+    for(;k>0 && less(node.elt(j),node.elt(order[k-1]));--k)
+      order[k] = order[k-1];
+    order[k] = j;
+  }
+}
+
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::rank(
+    const key_type& key) const -> size_type {
+  static_assert(Traits::track_subtree_counts,
+      "rank() needs Traits::track_subtree_counts");
+  const node_type* node = &root;
+  size_type rv = 0;
+  while(true) {
+    // Like eraseRecursive(), keep going after a match to get lessCount.
+    elt_count_type lessCount = 0, found = -1;
+    for(elt_count_type i=0;i<node->elt_count();++i)
+      if(eq(node->elt(i),key)) found=i;
+      else if(less(node->elt(i),key)) lessCount++;
+    rv += lessCount;
+    if(!node->hasFamily()) return rv;
+    for(elt_count_type c=0;c<lessCount;++c)
+      rv += node->family->subtreeCount(c);
+    if(found>=0) return rv+node->family->subtreeCount(lessCount);
+    node = &node->family->child[lessCount];
+  }
+}
+
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::select(size_type i) const
+    -> const_iterator {
+  static_assert(Traits::track_subtree_counts,
+      "select() needs Traits::track_subtree_counts");
+  if(i>=treeEltCount) return end();
+  const node_type* node = &root;
+  elt_count_type order[node_type::leaf_elt_count_max];
+  while(true) {
+    sortedOrder(*node,order);
+    const node_type* next = nullptr;
+    for(elt_count_type c=0;c<=node->elt_count();++c) {
+      size_type n = node->hasFamily()?node->family->subtreeCount(c):0;
+      if(i<n) { next = &node->family->child[c]; break; }
+      i -= n;
+      if(c==node->elt_count()) break;
+      if(i==0) return iteratorAt(node,order[c]);
+      i--;
+    }
+    if(next==nullptr) throw cashew_set_bug("Subtree counts are inconsistent");
+    node = next;
+  }
+}
+
+// Each slot holds one lookup, and moves it down a single level per pass. By
+// the time we come back to a slot, the node we prefetched for it has
+// hopefully arrived. Finished slots pick up the next key right away, starting
+// from the root, so the slots don't have to wait for each other.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::count_batch(
+    const key_type* keys, size_type n, size_type* out) const -> size_type {
+  constexpr int slot_count = Traits::lookups_in_flight;
+  const node_type* node[slot_count];
+  size_type pos[slot_count];
+  size_type next = 0, rv = 0;
+  int active = 0;
+  for(;active<slot_count && next<n;++active) {
+    node[active] = &root;
+    pos[active] = next++;
+  }
+  while(active>0) {
+    for(int q=0;q<active;++q) {
+      const node_type* p = node[q];
+      elt_count_type lessCount;
+      const bool found = findInNode(*p,keys[pos[q]],lessCount)>=0;
+      if(!found && p->hasFamily()) {
+        node[q] = &p->family->child[lessCount];
+        prefetch_line(&node[q]->family);
+        continue;
+      }
+      out[pos[q]] = found;
+      rv += found;
+      if(next<n) {
+        node[q] = &root;
+        pos[q] = next++;
+      }else {
+        // Fill the hole with the last slot, and look at it next.
+        --active;
+        node[q] = node[active];
+        pos[q] = pos[active];
+        --q;
+      }
+    }
+  }
+  return rv;
+}
+
 // Returns 0 or 1.
-template <class Elt, class Less, class Eq, class Traits>
-int cashew_set<Elt,Less,Eq,Traits>::countRecursive(
-    const node_type& node, key_type key) const {
-  elt_count_type lessCount = 0;
-  for(elt_count_type i=0;i<node.elt_count();++i)
-    if(eq(node.elt(i),key)) return 1;
-    else if(less(node.elt(i),key)) lessCount++;
-  return node.family==nullptr
-    ?0:countRecursive(node.family->child[lessCount],key);
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class Key>
+int cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::countRecursive(
+    const node_type& node, const Key& key) const {
+  elt_count_type lessCount;
+  if(findInNode(node,key,lessCount)>=0) return 1;
+  return node.hasFamily()
+    ?countRecursive(node.family->child[lessCount],key):0;
+}
+
+// The alignment check can only fail if alloc ignores alignof(family_type).
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::make_family()
+    -> typename node_type::family_pointer_type {
+  using alloc_traits =
+    std::allocator_traits<typename node_type::family_allocator>;
+  static_assert(std::is_same<typename alloc_traits::pointer,
+                             family_type*>::value,
+      "Allocators with fancy pointers are not supported");
+  family_type* p = alloc_traits::allocate(alloc,1);
+  if ((ptrdiff_t(p) & (Traits::cache_line_nbytes-1)) != 0) {
+    alloc_traits::deallocate(alloc,p,1);
+    throw cashew_set_bug("Allocator produced unaligned tree nodes. "
+        "It needs to honour alignof(), as C++17 allocators do.");
+  }
+  try {
+    return typename node_type::family_pointer_type(new (p) family_type(alloc));
+  }catch(...) {
+    alloc_traits::deallocate(alloc,p,1);
+    throw;
+  }
 }
 
-// Return value indicates if key was just inserted, or it had already existed.
+// Returns where key is, and whether it was just inserted, or it had already
+// existed.
+// Walks down once, remembering the path, and finds the deepest node on it
+// with room to spare. That is where key goes, see placeKey(). Inserts that
+// land in a leaf with room, as most do, never get past the first loop.
 // Provides basic exception safety: clears out the entire tree at the first
 // sign of trouble. Nothing is leaked.
-// Note to future me: tryInsert should return nullptr parts if root.family
-// starts out as nullptr.
-template <class Elt, class Less, class Eq, class Traits>
-bool cashew_set<Elt,Less,Eq,Traits>::insert(key_type key) {
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class K, class... Args>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::emplaceKey(
+    K&& key, Args&&... args) -> std::pair<EltRef,bool> {
+  // path[d-1] is the node at depth d.
+  PathStep path[max_tree_depth];
   try {
-    auto result=tryInsert(root,1,key);  // 1 == depth of root node.
-    if(result.status != InsStatus::familySplit)
-      return result.status != InsStatus::duplicateFound;
-
-    // People, we have bad news. tryInsert() has split our family.
-    // Step 1) Split up root into children.
-    root.family = make_family();
-    root.family->child[0].family=std::move(result.family0);
-    root.family->child[1].family=std::move(result.family1);
-    root.splitElts(root.family->child[0],root.family->child[1],key,less);
-
-    // Step 2) Reset root. This is the only step that increments treeDepth.
-    root.addElt(key);
-    treeDepth++;
-    treeEltCount++;
-    return true;
+    // Depth of the deepest node with room for key, or 0 if there is none.
+    depth_type spacious = 0;
+    node_type* node = &root;
+    for(depth_type d=1;;++d) {
+      elt_count_type lessCount;
+      const elt_count_type i = findInNode(*node,key,lessCount);
+      if(i>=0) return {EltRef{node,i},false};
+      path[d-1] = {node,lessCount};
+      if(node->elt_count() < nodeCapacity(d)) spacious = d;
+      if(d==treeDepth) break;
+      // Erase may leave a non-leaf node without a family, if all its children
+      // were emptied out.
+      if(node->family==nullptr) node->family = make_family();
+      node = &node->family->child[lessCount];
+    }
+    checkBugs(*node,treeDepth);
+    return {placeKey(path,spacious,std::forward<K>(key),
+                     std::forward<Args>(args)...),true};
   }catch(...) {
     clear();
     throw;
   }
 }
 
+// Inserts key, which is not in the tree, given the path down to the leaf
+// where it belongs, and the depth of the deepest node on that path with room
+// to spare. That is where key goes. Every node below it is full, so on the
+// way back up, each of those splits around key and hands the two halves of
+// its family to the node above. If even the root is full, it splits too, and
+// the tree grows a level. Only the leaf changes if it had room.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class K, class... Args>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::placeKey(
+    const PathStep* path, depth_type spacious, K&& key, Args&&... args)
+    -> EltRef {
+  if(spacious<treeDepth) {
+    // A full leaf has no family to hand up, so the splitting starts with its
+    // parent. Nothing has been inserted, so key is still good as a pivot.
+    family_pointer family0, family1;
+    for(depth_type d=treeDepth-1;d>spacious;--d)
+      splitFamily(*path[d-1].node,path[d-1].lessCount,key,family0,family1);
+    if(spacious==0) {
+      // People, we have bad news. The root has to split. A wide leaf root
+      // has to empty out before it has room for a family.
+      if(treeDepth==max_tree_depth)
+        throw cashew_set_bug("Tree is too deep.");
+      auto family = make_family();
+      family->child[0].family=std::move(family0);
+      family->child[1].family=std::move(family1);
+      root.splitElts(family->child[0],family->child[1],key,less);
+      root.family = std::move(family);
+      recountFamily(*root.family);
+      // This is the only place that increments treeDepth.
+      root.addElt(std::forward<K>(key),std::forward<Args>(args)...);
+      treeDepth++;
+      treeEltCount++;
+      return EltRef{&root,elt_count_type(root.elt_count()-1)};
+    }
+    absorbChildSplit(*path[spacious-1].node,path[spacious-1].lessCount,key,
+                     family0,family1);
+  }
+
+  // Append key to node.elts, or put it in its place if they are sorted.
+  const PathStep& step = path[spacious-1];
+  step.node->addElt(std::forward<K>(key),std::forward<Args>(args)...);
+  treeEltCount++;
+  const EltRef where{step.node,step.node->moveLastTo(step.lessCount)};
+  for(depth_type d=spacious-1;d>0;--d)
+    recountChild(*path[d-1].node,path[d-1].lessCount);
+  return where;
+}
+
 // Move arr[0..len-1] to arr[1..len]. Assumes arr[] can actually hold len+1
 // elements.
 template<class X> void shiftArray(X* arr,size_t len) {
   for(size_t i=len;i>0;--i) arr[i]=std::move(arr[i-1]);
 }
 
-template <class Elt, class Less, class Eq, class Traits>
-void cashew_set<Elt,Less,Eq,Traits>::checkBugs(const node_type& node,
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::checkBugs(
+    const node_type& node,
     depth_type nodeDepth) const {
-  if(node.elt_count() > node.elt_count_max)
+  if(node.elt_count() > nodeCapacity(nodeDepth))
     throw cashew_set_bug("Node is corrupted. Element count too large.");
   if(nodeDepth > treeDepth) 
     throw cashew_set_bug("Node is deeper than it's supposed to be.");
-  if(nodeDepth==treeDepth && node.family!=nullptr)
+  if(nodeDepth==treeDepth && node.hasFamily())
     throw cashew_set_bug("It's too deep for having children");
 }
 
-// Attempts to insert key into node. There are three possible outcomes, as
-// indicated by InsStatus. If a family-split happens, it is upto the caller to
-// clean that up the levels of the tree at node and above.
-template <class Elt, class Less, class Eq, class Traits>
-auto cashew_set<Elt,Less,Eq,Traits>::tryInsert(
+// copy_n is in standard library, move_n isn't. Facepalm.
+template <class InputIt,class Size,class OutputIt>
+OutputIt move_n(InputIt first,Size count, OutputIt result) {
+  while(count-->0) *result++ = std::move(*first++);
+  return result;
+}
+
+// Scans the whole node, unless its elements are sorted.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::successorIn(
+    const node_type& node,
+    const key_type& key,
+    elt_count_type lessCount) const -> const Elt* {
+  if(lessCount==node.elt_count()) return nullptr;
+  if(Traits::sorted_within_node) return &node.elt(lessCount);
+  const Elt* rv = nullptr;
+  for(elt_count_type i=0;i<node.elt_count();++i)
+    if(less(key,node.elt(i)) && (rv==nullptr || less(node.elt(i),*rv)))
+      rv = &node.elt(i);
+  return rv;
+}
+
+// node is full, and its child at lessCount has just split around key, into
+// families family0 and family1. Splits node's own family around key the same
+// way, and hands the halves back in family0 and family1. That leaves node
+// without a family, until the node above splits node itself.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::splitFamily(
+    node_type& node,
+    elt_count_type lessCount,
+    const key_type& key,
+    family_pointer& family0,
+    family_pointer& family1) {
+  const elt_count_type child_count = node.elt_count()+1;
+  auto nibling = make_family();
+
+  // Let our larger children be adopted by the new sibling family.
+  move_n(node.family->child+lessCount+1, child_count-lessCount-1,
+         nibling->child+1);
+  node_type &lt_node=node.family->child[lessCount];
+  node_type &gt_node=nibling->child[0];
+  adoptFamilies(lt_node,gt_node,family0,family1);
+  lt_node.splitEltsInto(gt_node,key,less);
+  recountFamily(*node.family);
+  recountFamily(*nibling);
+  family0 = std::move(node.family);
+  family1 = std::move(nibling);
+}
+
+// node has room for key, and its child at lessCount has just split around
+// key, into families family0 and family1. Splits the child itself, making
+// room for the new half in node's family. O(n) in the number of children.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::absorbChildSplit(
+    node_type& node,
+    elt_count_type lessCount,
+    const key_type& key,
+    family_pointer& family0,
+    family_pointer& family1) {
+  const elt_count_type child_count = node.elt_count()+1;
+  shiftArray(node.family->child+lessCount+1,child_count-lessCount-1);
+  node_type &lt_node = node.family->child[lessCount];
+  node_type &gt_node = node.family->child[lessCount+1];
+  adoptFamilies(lt_node,gt_node,family0,family1);
+  lt_node.splitEltsInto(gt_node,key,less);
+  recountFamily(*node.family);
+}
+
+// Hands the families from a split child over to its two halves. Split leaves
+// come back without families, and wide ones may have elements where family
+// would be, so those are left alone.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::adoptFamilies(
+    node_type& lt_node,
+    node_type& gt_node,
+    family_pointer& family0,
+    family_pointer& family1) {
+  if(family0==nullptr) return;
+  lt_node.family = std::move(family0);
+  gt_node.family = std::move(family1);
+}
+
+// Picks the smallest depth that can hold all of the input with perNode
+// elements per node, and lets buildSorted() fill it in from the top. Since the
+// input arrives in order, this never compares anything beyond checking that
+// the input is sorted.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class ForwardIt>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::assign_sorted(
+    ForwardIt first, ForwardIt last, double fill) {
+  clear();
+  const size_type n = std::distance(first,last);
+  if(n==0) return;
+  elt_count_type perNode = elt_count_type(fill*node_type::elt_count_max);
+  if(perNode<1) perNode = 1;
+  if(perNode>node_type::elt_count_max) perNode = node_type::elt_count_max;
+  elt_count_type perLeaf = elt_count_type(fill*node_type::leaf_elt_count_max);
+  if(perLeaf<perNode) perLeaf = perNode;
+  if(perLeaf>node_type::leaf_elt_count_max)
+    perLeaf = node_type::leaf_elt_count_max;
+
+  // capacity is the number of elements a full subtree of treeDepth levels can
+  // hold.
+  size_type capacity = perLeaf;
+  while(capacity<n) {
+    capacity = capacity*(perNode+1)+perNode;
+    treeDepth++;
+  }
+  try {
+    const Elt* prev = nullptr;
+    buildSorted(root,n,capacity,perNode,perLeaf,first,prev);
+    treeEltCount = n;
+  }catch(...) {
+    clear();
+    throw;
+  }
+}
+
+// Moves the next n elements from it into the subtree under node, which can
+// hold up to capacity elements. Leaves get perLeaf elements, and other nodes
+// get perNode. Children are filled up from the left, one full subtree at a
+// time. The last two children split whatever is left between them, so the
+// right edge of the tree doesn't end in a chain of nearly empty nodes. prev
+// is the last element we placed, if any.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class ForwardIt>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::buildSorted(
+    node_type& node, size_type n, size_type capacity, elt_count_type perNode,
+    elt_count_type perLeaf, ForwardIt& it, const Elt*& prev) {
+  auto take = [&]() {
+    if(prev!=nullptr && !less(*prev,*it))
+      throw std::invalid_argument(
+          "cashew_set::assign_sorted needs sorted, distinct input");
+    node.addElt(*it);
+    prev = &node.elt(node.elt_count()-1);
+    ++it;
+  };
+  if(capacity==size_type(perLeaf)) {
+    while(n-->0) take();
+    return;
+  }
+  if(n==0) return;
+
+  const size_type childCapacity = (capacity-perNode)/(perNode+1);
+  // Fewest children that can hold n elements, along with the separators. But
+  // at least two, so that we don't leave an empty node above a single child.
+  const size_type childCount =
+    std::max(size_type(2),(n+1+childCapacity)/(childCapacity+1));
+  node.family = make_family();
+  size_type left = n-(childCount-1);
+  for(size_type c=0;c<childCount;++c) {
+    size_type childSize = childCapacity;
+    if(c+2==childCount) childSize = (left+1)/2;
+    else if(c+1==childCount) childSize = left;
+    buildSorted(node.family->child[c],childSize,childCapacity,perNode,
+                perLeaf,it,prev);
+    left -= childSize;
+    if(c+1<childCount) take();
+  }
+  recountFamily(*node.family);
+}
+
+// Smaller batches are inserted in one walk over the tree, in sorted order.
+// Each key starts from the deepest node on the previous key's path that
+// still covers it, rather than from the root, so keys that share a leaf
+// share the walk down to it, and each node is visited once per run of keys
+// under it. A split anywhere but the leaf sends the next key back to the
+// root.
+// If the batch has at least as many distinct keys as the set already does,
+// it's cheaper to merge the two in a single pass, and rebuild the tree with
+// assign_sorted(). That holds a merged copy of both until the rebuild is
+// done, but never more than twice the batch.
+// Provides basic exception safety, the same way insert() does: clears out the
+// entire tree at the first sign of trouble.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class InputIt>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::insert_batch(
+    InputIt first, InputIt last, std::vector<bool>* inserted) -> size_type {
+  static_assert(std::is_void<Mapped>::value,
+      "insert_batch() has no values to insert into a map");
+  std::vector<key_type> keys(first,last);
+  // order[j] is the position in the batch of the j-th smallest distinct key.
+  // We only need it to fill in inserted.
+  std::vector<size_type> order;
+  if(inserted!=nullptr) {
+    inserted->assign(keys.size(),false);
+    order.resize(keys.size());
+    for(size_type i=0;i<order.size();++i) order[i]=i;
+    std::stable_sort(order.begin(),order.end(),
+        [&](size_type a,size_type b) { return less(keys[a],keys[b]); });
+    order.erase(std::unique(order.begin(),order.end(),
+        [&](size_type a,size_type b) { return eq(keys[a],keys[b]); }),
+        order.end());
+  }else {
+    std::sort(keys.begin(),keys.end(),less);
+    keys.erase(std::unique(keys.begin(),keys.end(),eq),keys.end());
+  }
+  const size_type distinct = inserted!=nullptr?order.size():keys.size();
+  auto key = [&](size_type j) -> const key_type& {
+    return inserted!=nullptr?keys[order[j]]:keys[j];
+  };
+  auto markNew = [&](size_type j) {
+    if(inserted!=nullptr) (*inserted)[order[j]]=true;
+  };
+
+  size_type rv = 0;
+  if(distinct<treeEltCount) {
+    // path[d-1] is the node at depth d, as in emplaceKey(), and hi[d-1] is
+    // the smallest element above its range, or nullptr if there is none.
+    // Only as much of the path as kept is still good.
+    PathStep path[max_tree_depth];
+    const Elt* hi[max_tree_depth];
+    hi[0] = nullptr;
+    depth_type kept = 0;
+    try {
+      for(size_type j=0;j<distinct;++j) {
+        const key_type& k = key(j);
+        // Keys come in order, so k is above the range of nothing on the path.
+        while(kept>1 && hi[kept-1]!=nullptr && !less(k,*hi[kept-1])) --kept;
+        depth_type d = kept>0?kept:1;
+        node_type* node = kept>0?path[kept-1].node:&root;
+        bool found = false;
+        for(;;++d) {
+          path[d-1].node = node;
+          if(findInNode(*node,k,path[d-1].lessCount)>=0) {
+            found = true;
+            break;
+          }
+          if(d==treeDepth) break;
+          if(node->family==nullptr) node->family = make_family();
+          const elt_count_type lessCount = path[d-1].lessCount;
+          const Elt* bound = successorIn(*node,k,lessCount);
+          hi[d] = bound!=nullptr?bound:hi[d-1];
+          node = &node->family->child[lessCount];
+        }
+        kept = d;
+        if(found) continue;
+        checkBugs(*node,treeDepth);
+        depth_type spacious = treeDepth;
+        while(spacious>0 &&
+              path[spacious-1].node->elt_count()>=nodeCapacity(spacious))
+          --spacious;
+        placeKey(path,spacious,k);
+        markNew(j);
+        rv++;
+        // Splits move elements around above the leaf, bounds included.
+        if(spacious<treeDepth) kept = 0;
+      }
+    }catch(...) {
+      clear();
+      throw;
+    }
+    return rv;
+  }
+  std::vector<key_type> merged;
+  merged.reserve(treeEltCount+distinct);
+  size_type j=0;
+  for(const key_type& x : *this) {
+    for(;j<distinct && less(key(j),x);++j) {
+      merged.push_back(key(j));
+      markNew(j);
+      rv++;
+    }
+    if(j<distinct && eq(key(j),x)) ++j;
+    merged.push_back(x);
+  }
+  for(;j<distinct;++j) {
+    merged.push_back(key(j));
+    markNew(j);
+    rv++;
+  }
+  assign_sorted(merged.begin(),merged.end());
+  return rv;
+}
+
+// Provides basic exception safety, the same way insert() does: clears out the
+// entire tree at the first sign of trouble.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class Key>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::eraseKey(
+    const Key& key) -> size_type {
+  try {
+    if(!eraseRecursive(root,1,key)) return 0;
+    treeEltCount--;
+
+    // Shrink the tree while the root is part of an empty chain. This is the
+    // only place that decrements treeDepth.
+    while(root.elt_count()==0 && root.family!=nullptr) {
+      typename node_type::family_pointer_type family=std::move(root.family);
+      root=std::move(family->child[0]);
+      treeDepth--;
+    }
+    if(root.elt_count()==0) treeDepth=1;
+    return 1;
+  }catch(...) {
+    clear();
+    throw;
+  }
+}
+
+// Returns true if key was found and removed from the subtree under node.
+// Descendants of node that end up underfull get merged with their siblings on
+// the way back up. But node itself is left for the caller to rebalance.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+template <class Key>
+bool cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::eraseRecursive(
     node_type& node,
     depth_type nodeDepth,
-    key_type key) -> TryInsertResult {
+    const Key& key) {
 
   checkBugs(node,nodeDepth);
 
-  elt_count_type lessCount = 0;
+  // Unlike emplaceKey, we don't stop at the first match: eraseAt() needs the
+  // rank of the element, which is the same as lessCount.
+  elt_count_type lessCount = 0, found = -1;
   for(elt_count_type i=0;i<node.elt_count();++i)
-    if(eq(node.elt(i),key)) return {nullptr,nullptr,InsStatus::duplicateFound};
+    if(eq(node.elt(i),key)) found=i;
     else if(less(node.elt(i),key)) lessCount++;
 
-  if(node.elt_count() < node.elt_count_max)
-    // There is no way this node will have to split.
-    return insertSpacious(node,nodeDepth,key,lessCount);
-  else
-    // node.elt_count() == node.elt_count_max, so we may have to split.
-    return insertFull(node,nodeDepth,key,lessCount);
-}
-
-// Assumes without checking:
-//   node.elt_count() < node.elt_count_max
-//   nodeDepth <= treeDepth
-//   if (nodeDepth == treeDepth) {
-//     node is a leaf
-//     node.family == nullptr
-//     we don't propagate farther down.
-//   }
-//   key has no duplicate directly in node.
-//   lessCount == count_if(node.elts, node.elts+node.elt_count(),
-//                         bind(less,_1,key))
-//     which also implies 0 <= lessCount <= node.elt_count()
-// Inserts key in subtree under node. Never returns familySplit.
-template <class Elt, class Less, class Eq, class Traits>
-auto cashew_set<Elt,Less,Eq,Traits>::insertSpacious(
+  if(found>=0) {
+    eraseAt(node,nodeDepth,found,lessCount);
+    return true;
+  }
+  if(!node.hasFamily()) return false;
+  if(!eraseRecursive(node.family->child[lessCount],nodeDepth+1,key))
+    return false;
+  rebalanceChild(node,nodeDepth,lessCount);
+  return true;
+}
+
+// Removes node.elt(i), which has the given rank among node's elements. Its
+// place is taken by its in-order predecessor or successor, whichever one
+// exists. If neither exists, both the neighbouring subtrees are empty, and
+// one of them gets dropped along with the element.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::eraseAt(
     node_type& node,
     depth_type nodeDepth,
-    key_type key,
-    elt_count_type lessCount) -> TryInsertResult {
-
-  if(nodeDepth<treeDepth) {
-    if(node.family==nullptr) node.family = make_family();
-
-    auto result = tryInsert(node.family->child[lessCount],nodeDepth+1,key);
-    if(result.status!=InsStatus::familySplit) return result;
-
-    // O(n) insert of result.family into node.family,
-    // at position lessCount+1.
-    const elt_count_type child_count = node.elt_count()+1;
-    shiftArray(node.family->child+lessCount+1,child_count-lessCount-1);
-    node_type &lt_node = node.family->child[lessCount];
-    node_type &gt_node = node.family->child[lessCount+1];
-    lt_node.family = std::move(result.family0);
-    gt_node.family = std::move(result.family1);
-    lt_node.splitEltsInto(gt_node,key,less);
+    elt_count_type i,
+    elt_count_type rank) {
+  if(node.hasFamily()) {
+    if(!subtreeEmpty(node.family->child[rank])) {
+      popMaxInto(node.family->child[rank],nodeDepth+1,node,i);
+      rebalanceChild(node,nodeDepth,rank);
+      return;
+    }
+    if(!subtreeEmpty(node.family->child[rank+1])) {
+      popMinInto(node.family->child[rank+1],nodeDepth+1,node,i);
+      rebalanceChild(node,nodeDepth,rank+1);
+      return;
+    }
+    removeChild(node,rank+1);
   }
+  node.removeElt(i);
+  dropEmptyFamily(node);
+}
 
-  // Append key to node.elts.
-  node.addElt(key);
-  treeEltCount++;
-  return {nullptr,nullptr,InsStatus::done};
+// Removes the largest element under node, and moves it into dest.elt(i),
+// along with its value. Assumes the subtree is not empty.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::popMaxInto(
+    node_type& node,
+    depth_type nodeDepth,
+    node_type& dest,
+    elt_count_type i) {
+  const elt_count_type c = node.elt_count();
+  if(node.hasFamily() && !subtreeEmpty(node.family->child[c])) {
+    popMaxInto(node.family->child[c],nodeDepth+1,dest,i);
+    rebalanceChild(node,nodeDepth,c);
+    return;
+  }
+  // The largest element is right here, and the subtree to its right is empty.
+  elt_count_type j = indexOfRank(node,c-1);
+  dest.replaceElt(i,node,j);
+  if(node.hasFamily()) node.family->child[c].clear();
+  node.removeElt(j);
+  dropEmptyFamily(node);
 }
 
-// copy_n is in standard library, move_n isn't. Facepalm.
-template <class InputIt,class Size,class OutputIt>
-OutputIt move_n(InputIt first,Size count, OutputIt result) {
-  while(count-->0) *result++ = std::move(*first++);
-  return result;
+// Removes the smallest element under node, and moves it into dest.elt(i),
+// along with its value. Assumes the subtree is not empty.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::popMinInto(
+    node_type& node,
+    depth_type nodeDepth,
+    node_type& dest,
+    elt_count_type i) {
+  if(node.hasFamily() && !subtreeEmpty(node.family->child[0])) {
+    popMinInto(node.family->child[0],nodeDepth+1,dest,i);
+    rebalanceChild(node,nodeDepth,0);
+    return;
+  }
+  elt_count_type j = indexOfRank(node,0);
+  dest.replaceElt(i,node,j);
+  if(node.hasFamily()) removeChild(node,0);
+  node.removeElt(j);
+  dropEmptyFamily(node);
 }
 
-// Assumes without checking:
-//   node.elt_count() == node.elt_count_max
-//   nodeDepth <= treeDepth
-//   if (nodeDepth == treeDepth) {
-//     node is a leaf
-//     node.family == nullptr
-//     we don't propagate farther down.
-//   }
-//   key has no duplicate directly in node.
-//   lessCount == count_if(node.elts, node.elts+node.elt_count(),
-//                         bind(less,_1,key))
-//     which also implies 0 <= lessCount <= node.elt_count()
-// Inserts key in subtree under node. Propagates any familySplit.
-template <class Elt, class Less, class Eq, class Traits>
-auto cashew_set<Elt,Less,Eq,Traits>::insertFull(
+// Called after node.family->child[c] has lost an element. If the child is
+// less than half full, we try to merge it with one of its siblings. The
+// insert logic doesn't care how full a node is, so this is only to keep
+// memory usage from lingering after a lot of erase() calls.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::rebalanceChild(
     node_type& node,
     depth_type nodeDepth,
-    key_type key,
-    elt_count_type lessCount) -> TryInsertResult {
-  if(nodeDepth==treeDepth) return {nullptr,nullptr,InsStatus::familySplit};
-  if(node.family==nullptr)
-    throw cashew_set_bug("Full leaf node should only appear at leaf level");
+    elt_count_type c) {
+  if(!node.hasFamily()) return;
+  const node_type* child = node.family->child;
+  const elt_count_type capacity = nodeCapacity(nodeDepth+1);
+  if(2*child[c].elt_count() < capacity) {
+    if(c<node.elt_count() &&
+       child[c].elt_count()+child[c+1].elt_count() < capacity)
+      mergeChildren(node,c);
+    else if(c>0 &&
+       child[c-1].elt_count()+child[c].elt_count() < capacity)
+      mergeChildren(node,c-1);
+    else recountChild(node,c);
+  } else recountChild(node,c);
+  dropEmptyFamily(node);
+}
 
-  auto result = tryInsert(node.family->child[lessCount],nodeDepth+1,key);
-  if(result.status!=InsStatus::familySplit) return result;
+// Merges node.family->child[c+1] into child[c], along with the element that
+// separates them. This removes an element from node, and frees the family of
+// child[c+1] if it had one. Assumes the result fits in a single node.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::mergeChildren(
+    node_type& node,
+    elt_count_type c) {
+  node_type& lt_node = node.family->child[c];
+  node_type& gt_node = node.family->child[c+1];
+  const elt_count_type lt_count = lt_node.elt_count();
+  const elt_count_type sep = indexOfRank(node,c);
 
+  if(gt_node.hasFamily()) {
+    if(!lt_node.hasFamily()) {
+      // All lt_count+1 children of lt_node are empty, even if it holds
+      // elements: merging two bare empty siblings leaves one with a separator
+      // and no family. Reuse gt_node's family for the merged node, moving
+      // its children past those empty ones. Slots moved from are left empty.
+      node_type* child = gt_node.family->child;
+      for(elt_count_type k=gt_node.elt_count();k>=0;--k)
+        child[k+lt_count+1] = std::move(child[k]);
+      lt_node.family=std::move(gt_node.family);
+    } else {
+      move_n(gt_node.family->child,gt_node.elt_count()+1,
+             lt_node.family->child+lt_count+1);
+      gt_node.family.reset();
+    }
+  }
+  // If only gt_node.family is nullptr, all of its children were empty anyway.
+  // The unused children of lt_node are already empty, so nothing needs
+  // moving.
+  lt_node.moveEltFrom(node,sep);
+  lt_node.appendElts(gt_node);
+  if(lt_node.hasFamily()) recountFamily(*lt_node.family);
+
+  removeChild(node,c+1);
+  node.removeElt(sep);
+}
+
+// Removes node.family->child[c] by shifting the larger children left, and
+// frees whatever was left under it. Does not touch node.elts(), but does
+// update subtree counts.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::removeChild(
+    node_type& node,
+    elt_count_type c) {
+  node_type* child = node.family->child;
   const elt_count_type child_count = node.elt_count()+1;
-  auto nibling = make_family();
+  child[c].clear();
+  for(elt_count_type i=c;i+1<child_count;++i) child[i]=std::move(child[i+1]);
+  child[child_count-1].clear();
+  recountFamily(*node.family);
+}
 
-  // Let our larger children be adopted by the new sibling family.
-  move_n(node.family->child+lessCount+1, child_count-lessCount-1,
-         nibling->child+1);
-  node_type &lt_node=node.family->child[lessCount];
-  node_type &gt_node=nibling->child[0];
-  lt_node.family=std::move(result.family0);
-  gt_node.family=std::move(result.family1);
-  lt_node.splitEltsInto(gt_node,key,less);
-  return {std::move(node.family),std::move(nibling),InsStatus::familySplit};
+// Frees node.family if node has no elements, and its only child is empty.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::dropEmptyFamily(
+    node_type& node) {
+  if(node.elt_count()!=0 || node.family==nullptr) return;
+  const node_type& child = node.family->child[0];
+  if(child.elt_count()==0 && child.family==nullptr) node.family.reset();
+}
+
+// Follows the chain of empty nodes, if any, below node.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+bool cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::subtreeEmpty(
+    const node_type& node) {
+  const node_type* p = &node;
+  while(p->elt_count()==0) {
+    if(p->family==nullptr) return true;
+    p = &p->family->child[0];
+  }
+  return false;
+}
+
+// Returns the index of the element that would have been at position rank,
+// had node.elts() been sorted. Quadratic, but this is only used when nodes
+// are being rearranged.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::indexOfRank(
+    const node_type& node,
+    elt_count_type rank) const -> elt_count_type {
+  if(Traits::sorted_within_node && rank<node.elt_count()) return rank;
+  for(elt_count_type i=0;i<node.elt_count();++i) {
+    elt_count_type lessCount = 0;
+    for(elt_count_type j=0;j<node.elt_count();++j)
+      if(less(node.elt(j),node.elt(i))) lessCount++;
+    if(lessCount==rank) return i;
+  }
+  throw cashew_set_bug("Requested rank is out of range");
+}
+
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+auto cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::subtreeSize(
+    const node_type& node)
+    -> size_type {
+  size_type rv = node.elt_count();
+  if(node.hasFamily())
+    for(elt_count_type c=0;c<=node.elt_count();++c)
+      rv += node.family->subtreeCount(c);
+  return rv;
+}
+
+// Refreshes the count of a single child, after something changed under it.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::recountChild(
+    node_type& node, elt_count_type c) {
+  if(!Traits::track_subtree_counts) return;
+  node.family->setSubtreeCount(c,subtreeSize(node.family->child[c]));
+}
+
+// Refreshes all counts in family, after children have been moved around.
+// Assumes counts in families further down are already correct. Unused
+// children are empty, so their counts come out as zero.
+template <class Elt, class Less, class Eq, class Traits, class Alloc,
+          class Mapped>
+void cashew_set<Elt,Less,Eq,Traits,Alloc,Mapped>::recountFamily(
+    family_type& family) {
+  if(!Traits::track_subtree_counts) return;
+  for(elt_count_type c=0;c<node_type::elt_count_max+1;++c)
+    family.setSubtreeCount(c,subtreeSize(family.child[c]));
 }
 
 }  // namespace cashew
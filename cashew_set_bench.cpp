@@ -9,6 +9,8 @@
 
 #ifdef BENCH_CASHEW
 #include "cashew_set.h"
+#include "frozen_cashew_set.h"
+#include "packed_frozen_set.h"
 using namespace cashew;
 #endif
 
@@ -25,6 +27,7 @@ using namespace __gnu_cxx;
 #include <algorithm>
 #include <ctime>
 #include <iostream>
+#include <random>
 #include <vector>
 using namespace std;
 
@@ -73,9 +76,65 @@ template <class IntSet> void timeOps() {
       <<wallClock()-start<<" sec"<<endl;
 }
 
+#ifdef BENCH_CASHEW
+struct SortedTraits : CashewSetTraits<int32_t> {
+  static constexpr bool sorted_within_node = true;
+};
+struct HugePageTraits : CashewSetTraits<int32_t> {
+  static constexpr bool huge_page_nodes = true;
+};
+
+void timeBatchOps() {
+  const size_t size=30000000;
+  size_t i;
+  mt19937 rng(1);
+  cashew_set<int32_t> s;
+  vector<int32_t> v(size);
+  for(i=0;i<size;++i) v[i]=int32_t(i);
+  shuffle(v.begin(),v.end(),rng);
+  for(i=0;i<size;++i) s.insert(v[i]*2);
+
+  for(i=0;i<size;++i) v[i]*=2;
+  shuffle(v.begin(),v.end(),rng);
+  vector<size_t> counts(size);
+  double start = wallClock();
+  size_t count=s.count_batch(v.data(),size,counts.data());
+  cout<<"Batch searched "<<size<<" elements in random order, found "<<count
+      <<": "<<wallClock()-start<<" sec"<<endl;
+
+  auto f = freeze(s);
+  auto p = freeze_packed(s);
+  s.clear();
+  shuffle(v.begin(),v.end(),rng);
+  count=0;
+  start = wallClock();
+  for(i=0;i<size;++i) count+=f.count(v[i]);
+  cout<<"Searched "<<size<<" elements in a frozen copy, found "<<count
+      <<": "<<wallClock()-start<<" sec"<<endl;
+  start = wallClock();
+  count=f.count_batch(v.data(),size,counts.data());
+  cout<<"Batch searched "<<size<<" elements in a frozen copy, found "<<count
+      <<": "<<wallClock()-start<<" sec"<<endl;
+
+  count=0;
+  start = wallClock();
+  for(i=0;i<size;++i) count+=p.count(v[i]);
+  cout<<"Searched "<<size<<" elements in a packed copy of "<<p.nbytes()
+      <<" bytes, found "<<count<<": "<<wallClock()-start<<" sec"<<endl;
+}
+#endif
+
 int main() {
 #ifdef BENCH_CASHEW
   timeOps<cashew_set<int32_t>>();
+  timeBatchOps();
+  cout<<"With elements sorted within each node:"<<endl;
+  timeOps<cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,SortedTraits>>();
+  cout<<"With families on huge pages:"<<endl;
+  timeOps<cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,HugePageTraits>>();
+  CashewHugePageStats stats = cashew_huge_page_stats();
+  cout<<stats.huge_nbytes<<" of "<<stats.mapped_nbytes
+      <<" bytes were on huge pages"<<endl;
 #endif
 #ifdef BENCH_STD
   timeOps<set<int32_t>>();
@@ -3,8 +3,15 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <random>
+#include <set>
+#include <stdexcept>
 #include <vector>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
 using namespace cashew;
 using namespace std;
 
@@ -16,6 +23,45 @@ void testNodeAlignment() {
   auto p = make_aligned_unique<node_type[],traits_type::cache_line_nbytes>(10);
   assert((ptrdiff_t(p.get()) & (CashewSetTraits<int>::cache_line_nbytes-1))
       == 0);
+  // Families don't grow unless asked to.
+  static_assert(sizeof(node_type::family_type)==
+      sizeof(node_type)*traits_type::children_per_node,
+      "Default families should only hold child nodes");
+}
+
+struct CountingTraits : CashewSetTraits<int32_t> {
+  static constexpr bool track_subtree_counts = true;
+};
+using countedIntSet =
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,CountingTraits>;
+
+void testOrderStatistics() {
+  countedIntSet s;
+  assert(s.rank(5)==0);
+  assert(s.select(0)==s.end());
+
+  // Multiples of 3, in random order.
+  vector<int> v(30000);
+  for(int i=0;i<v.size();++i) v[i]=3*i;
+  random_shuffle(v.begin(),v.end());
+  for(int x:v) s.insert(x);
+  for(int i=0;i<v.size();++i) {
+    assert(*s.select(i)==3*i);
+    assert(s.rank(3*i)==i);
+    assert(s.rank(3*i+1)==i+1);
+  }
+  assert(s.select(v.size())==s.end());
+  assert(s.count_range(0,30)==10);
+  assert(s.count_range(1,31)==10);
+  assert(s.count_range(31,1)==0);
+
+  // Erase the odd multiples, and check again.
+  for(int x:v) if(x%2) s.erase(x);
+  for(int i=0;2*i<v.size();++i) {
+    assert(*s.select(i)==6*i);
+    assert(s.rank(6*i)==i);
+  }
+  assert(s.count_range(0,60)==10);
 }
 
 // Make sure we get enough inserts to produce a 3-deep tree.
@@ -79,6 +125,455 @@ void testRandomInserts() {
   assert(s.count(200000)==0);
 }
 
+template <class X> void testSmallErases() {
+  int ic = smallInsertCount<X>();
+  cashew_set<X> s;
+  assert(s.erase(X(1))==0);
+  for(int i=1;i<=2*ic;++i) s.insert(X(i));
+
+  // Erase odd numbers going forward.
+  int prev_size = s.size();
+  for(int i=1;i<=2*ic;i+=2) {
+    assert(s.erase(X(i))==1);
+    assert(s.erase(X(i))==0);
+    assert(s.count(X(i))==0);
+    assert(s.count(X(i+1))==1);
+    assert(s.size()==--prev_size);
+  }
+  // Erase even numbers going backwards.
+  for(int i=2*ic;i>=2;i-=2) {
+    assert(s.erase(X(i))==1);
+    assert(s.count(X(i))==0);
+    if(i>2) assert(s.count(X(i-2))==1);
+    assert(s.size()==--prev_size);
+  }
+  assert(s.empty());
+
+  // Things should still work after everything is gone.
+  assert(s.insert(X(5)));
+  assert(s.count(X(5))==1);
+  assert(s.size()==1);
+}
+
+void testRandomErases() {
+  vector<int> v(100000);
+  for(int i=0;i<v.size();++i) v[i]=i;
+  random_shuffle(v.begin(),v.end());
+
+  intSet s;
+  for(int x:v) s.insert(x);
+  random_shuffle(v.begin(),v.end());
+  const int half = v.size()/2;
+  for(int i=0;i<half;++i) {
+    assert(s.erase(v[i])==1);
+    assert(s.count(v[i])==0);
+  }
+  assert(s.size()==v.size()-half);
+  for(int i=0;i<half;++i) assert(s.count(v[i])==0);
+  for(int i=half;i<v.size();++i) assert(s.count(v[i])==1);
+
+  // Put some of them back, and erase everything.
+  for(int i=0;i<half;i+=2) assert(s.insert(v[i]));
+  for(int i=0;i<v.size();++i) s.erase(v[i]);
+  assert(s.empty());
+  for(int x:v) assert(s.count(x)==0);
+}
+
+// Mostly erases, with inserts mixed in, on small trees of int64_t. Seed 410
+// gets erase to merge two empty interior nodes without families, and later
+// merge the result with a sibling that has one.
+void testRandomInsertErase() {
+  for(unsigned seed=405;seed<415;++seed) {
+    mt19937 rng(seed);
+    const int range = 60+rng()%400;
+    cashew_set<int64_t> s;
+    set<int64_t> ref;
+    for(int op=0;op<6000;++op) {
+      const int x = rng()%range;
+      if(rng()%3==0) assert(s.insert(x)==ref.insert(x).second);
+      else assert(s.erase(x)==ref.erase(x));
+      for(int y=0;y<range;++y) assert(s.count(y)==ref.count(y));
+    }
+    assert(s.size()==ref.size() && equal(ref.begin(),ref.end(),s.begin()));
+  }
+}
+
+template <class X> void testIteration() {
+  int ic = smallInsertCount<X>();
+  cashew_set<X> s;
+  assert(s.begin()==s.end());
+
+  vector<X> v;
+  for(int i=1;i<=ic;++i) v.push_back(X(i));
+  random_shuffle(v.begin(),v.end());
+  for(X x:v) s.insert(x);
+  sort(v.begin(),v.end());
+  assert(equal(v.begin(),v.end(),s.begin()));
+  assert(distance(s.begin(),s.end())==v.size());
+
+  // Walk backwards from end().
+  auto it=s.end();
+  for(int i=v.size()-1;i>=0;--i) assert(*--it==v[i]);
+  assert(it==s.begin());
+
+  // Remove a few and make sure they don't show up.
+  for(int i=1;i<=ic;i+=3) s.erase(X(i));
+  int prev=0, n=0;
+  for(X x:s) {
+    assert(int(x)>prev && int(x)%3!=1);
+    prev=x;
+    n++;
+  }
+  assert(n==s.size());
+}
+
+void testRandomIteration() {
+  vector<int> v(100000);
+  for(int i=0;i<v.size();++i) v[i]=2*i;
+  random_shuffle(v.begin(),v.end());
+  intSet s;
+  for(int x:v) s.insert(x);
+  int expected=0;
+  for(auto it=s.begin();it!=s.end();it++) {
+    assert(*it==expected);
+    expected+=2;
+  }
+  assert(expected==2*v.size());
+  for(auto it=s.end();it!=s.begin();) assert(*--it==(expected-=2));
+}
+
+void testBounds() {
+  intSet s;
+  assert(s.lower_bound(5)==s.end());
+  assert(s.find(5)==s.end());
+
+  // Multiples of 3, in random order.
+  vector<int> v(30000);
+  for(int i=0;i<v.size();++i) v[i]=3*i;
+  random_shuffle(v.begin(),v.end());
+  for(int x:v) s.insert(x);
+  for(int x=-2;x<3*int(v.size())+2;++x) {
+    int next = (x+2)/3*3, after = x/3*3+3;
+    if(x<0) next = after = 0;
+    auto lb = s.lower_bound(x), ub = s.upper_bound(x);
+    if(next<3*v.size()) assert(*lb==next); else assert(lb==s.end());
+    if(after<3*v.size()) assert(*ub==after); else assert(ub==s.end());
+    auto range = s.equal_range(x);
+    assert(range.first==lb && range.second==ub);
+    if(x%3==0 && x>=0 && x<3*v.size()) {
+      assert(*s.find(x)==x);
+      assert(distance(range.first,range.second)==1);
+    } else {
+      assert(s.find(x)==s.end());
+      assert(range.first==range.second);
+    }
+  }
+}
+
+void testAssignSorted() {
+  intSet s;
+  vector<int> v;
+  s.assign_sorted(v.begin(),v.end());
+  assert(s.empty());
+
+  for(int n : {1,13,14,200,2745,100000}) {
+    v.resize(n);
+    for(int i=0;i<n;++i) v[i]=2*i;
+    for(double fill : {1.0,0.5,0.0}) {
+      s.assign_sorted(v.begin(),v.end(),fill);
+      assert(s.size()==n);
+      assert(equal(v.begin(),v.end(),s.begin()));
+      // The tree should be ready for regular updates.
+      for(int i=0;i<n;i+=7) assert(s.insert(2*i+1));
+      for(int i=0;i<n;i+=5) assert(s.erase(2*i)==1);
+      for(int i=0;i<n;++i) {
+        assert(s.count(2*i)==(i%5!=0));
+        assert(s.count(2*i+1)==(i%7==0));
+      }
+    }
+  }
+
+  countedIntSet cs;
+  cs.assign_sorted(v.begin(),v.end(),0.7);
+  for(int i=0;i<v.size();i+=97) {
+    assert(*cs.select(i)==v[i]);
+    assert(cs.rank(v[i])==i);
+  }
+
+  // Unsorted input leaves the set empty.
+  v[500]=v[499];
+  try {
+    s.assign_sorted(v.begin(),v.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+  assert(s.empty() && s.begin()==s.end());
+  assert(s.insert(5) && s.count(5)==1);
+}
+
+// Batches both larger and smaller than the set, with repeats. The smaller
+// ones are merged in place, and split nodes along the way. Leaves ref holding
+// what s should.
+template <class Set> void checkInsertBatch(Set& s, set<int>& ref) {
+  vector<int> batch;
+  vector<bool> inserted;
+  assert(s.insert_batch(batch.begin(),batch.end(),&inserted)==0);
+  assert(inserted.empty());
+
+  for(int n : {5000,1000,3000,20000,300,4000,50000,10000}) {
+    batch.resize(n);
+    for(int& x:batch) x=rand()%100000;
+    size_t expected = 0;
+    vector<bool> expectedMask(n);
+    for(int i=0;i<n;++i)
+      if(ref.insert(batch[i]).second) { expectedMask[i]=true; expected++; }
+    assert(s.insert_batch(batch.begin(),batch.end(),&inserted)==expected);
+    assert(inserted==expectedMask);
+    assert(s.size()==ref.size());
+    assert(equal(ref.begin(),ref.end(),s.begin()));
+    for(int x=0;x<100000;x+=7) assert(s.count(x)==ref.count(x));
+  }
+  // Inserting the same batch again finds nothing new.
+  assert(s.insert_batch(batch.begin(),batch.end())==0);
+  assert(s.size()==ref.size());
+}
+
+void testInsertBatch() {
+  intSet s;
+  set<int> ref;
+  checkInsertBatch(s,ref);
+  // Subtree counts stay right along the merged paths.
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,CountingTraits> t;
+  ref.clear();
+  checkInsertBatch(t,ref);
+  size_t i=0;
+  for(int x:ref) {
+    if(i%53==0) assert(t.rank(x)==i && *t.select(i)==x);
+    i++;
+  }
+}
+
+void testCountBatch() {
+  intSet s;
+  vector<int> keys(10000);
+  vector<size_t> counts(keys.size());
+  for(int i=0;i<keys.size();++i) keys[i]=i;
+  assert(s.count_batch(keys.data(),keys.size(),counts.data())==0);
+  assert(count(counts.begin(),counts.end(),0)==counts.size());
+
+  vector<int> v(20000);
+  for(int i=0;i<v.size();++i) v[i]=3*i;
+  random_shuffle(v.begin(),v.end());
+  for(int x:v) s.insert(x);
+  for(int& x:keys) x=rand()%70000;
+  // Sizes that don't fill up the slots, and some that do.
+  for(int n : {0,1,5,10000}) {
+    size_t expected = 0;
+    for(int i=0;i<n;++i) expected+=s.count(keys[i]);
+    assert(s.count_batch(keys.data(),n,counts.data())==expected);
+    for(int i=0;i<n;++i) assert(counts[i]==s.count(keys[i]));
+  }
+}
+
+// Keys on both sides of the sign bit, to catch node searches that compare
+// unsigned keys as signed ones, or the other way around.
+template <class X> void testExtremeKeys() {
+  const X lo = numeric_limits<X>::min(), hi = numeric_limits<X>::max();
+  const X spread = sizeof(X)==1?20:200;
+  vector<X> v;
+  for(X d=0;d<spread;++d) {
+    v.push_back(lo+d);
+    v.push_back(hi-d);
+    v.push_back(hi/2-d);
+    v.push_back(hi/2+d+1);
+    v.push_back(X(0)+d);
+    v.push_back(X(0)-d-1);
+  }
+  sort(v.begin(),v.end());
+  v.erase(unique(v.begin(),v.end()),v.end());
+  vector<X> shuffled = v;
+  random_shuffle(shuffled.begin(),shuffled.end());
+  cashew_set<X> s;
+  for(X x:shuffled) assert(s.insert(x));
+  for(X x:shuffled) assert(s.count(x)==1 && *s.find(x)==x);
+  assert(equal(v.begin(),v.end(),s.begin()));
+  assert(s.count(X(lo+spread))==0 && s.count(X(hi-spread))==0);
+}
+
+// Runs the integer tests once per node search tier this machine supports.
+void testSearchTiers() {
+  const CashewSearchTier best = cashew_best_search_tier();
+  assert(cashew_search_tier()==best);
+  for(auto tier : {CashewSearchTier::scalar,CashewSearchTier::sse42,
+                   CashewSearchTier::avx2,CashewSearchTier::avx512}) {
+    if(!cashew_force_search_tier(tier)) {
+      assert(tier>best && cashew_search_tier()!=tier);
+      continue;
+    }
+    assert(cashew_search_tier()==tier);
+    testExtremeKeys<int8_t>();
+    testExtremeKeys<uint8_t>();
+    testExtremeKeys<int16_t>();
+    testExtremeKeys<uint16_t>();
+    testExtremeKeys<int32_t>();
+    testExtremeKeys<uint32_t>();
+    testExtremeKeys<int64_t>();
+    testExtremeKeys<uint64_t>();
+    testRandomErases();
+    testIteration<uint8_t>();
+    testIteration<uint16_t>();
+  }
+  assert(cashew_force_search_tier(best));
+}
+
+struct BranchlessTraits : CashewSetTraits<int32_t> {
+  static constexpr bool branchless_node_search = true;
+};
+
+// greater<> has no vector kernel, so this goes through the unrolled scan.
+void testBranchlessSearch() {
+  cashew_set<int32_t,greater<int32_t>,equal_to<int32_t>,BranchlessTraits> s;
+  assert(s.count(0)==0);
+  vector<int> v(50000);
+  for(int i=0;i<v.size();++i) v[i]=2*i;
+  random_shuffle(v.begin(),v.end());
+  for(int x:v) assert(s.insert(x));
+  for(int x:v) assert(!s.insert(x));
+  for(int x:v) assert(s.count(x)==1 && s.count(x+1)==0 && *s.find(x)==x);
+  assert(*s.begin()==2*(v.size()-1));
+  for(int i=0;i<v.size();i+=2) assert(s.erase(v[i])==1);
+  for(int i=0;i<v.size();++i) assert(s.count(v[i])==i%2);
+
+  // Integer keys with the default comparators still work, whether or not
+  // they get a vector kernel.
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,BranchlessTraits> t;
+  for(int x:v) t.insert(x);
+  assert(cashew_force_search_tier(CashewSearchTier::scalar));
+  for(int x:v) assert(t.count(x)==1 && t.count(x+1)==0);
+  assert(cashew_force_search_tier(cashew_best_search_tier()));
+}
+
+struct SortedTraits : CashewSetTraits<int32_t> {
+  static constexpr bool sorted_within_node = true;
+};
+struct SortedCountingTraits : SortedTraits {
+  static constexpr bool track_subtree_counts = true;
+};
+
+// Nodes that keep their elements sorted. greater<> has no vector kernel, so
+// lookups go through the binary search.
+void testSortedWithinNode() {
+  cashew_set<int32_t,greater<int32_t>,equal_to<int32_t>,SortedTraits> s;
+  assert(s.count(0)==0 && s.begin()==s.end());
+  vector<int> v(50000);
+  for(int i=0;i<v.size();++i) v[i]=2*i;
+  random_shuffle(v.begin(),v.end());
+  for(int x:v) assert(s.insert(x));
+  for(int x:v) assert(!s.insert(x));
+  for(int x:v) assert(s.count(x)==1 && s.count(x+1)==0 && *s.find(x)==x);
+  int expected=2*(v.size()-1);
+  for(int x:s) {
+    assert(x==expected);
+    expected-=2;
+  }
+  assert(*s.lower_bound(7)==6 && *s.upper_bound(6)==4);
+  for(int i=0;i<v.size();i+=2) assert(s.erase(v[i])==1);
+  for(int i=0;i<v.size();++i) assert(s.count(v[i])==i%2);
+  assert(distance(s.begin(),s.end())==s.size());
+  for(auto it=s.end();it!=s.begin();) {
+    --it;
+    assert(s.count(*it)==1);
+  }
+
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,SortedCountingTraits> t;
+  for(int x:v) t.insert(x);
+  for(int i=0;i<v.size();i+=3) t.erase(v[i]);
+  vector<int> left;
+  for(int i=0;i<v.size();++i) if(i%3) left.push_back(v[i]);
+  sort(left.begin(),left.end());
+  assert(equal(left.begin(),left.end(),t.begin()));
+  for(int i=0;i<left.size();i+=101) {
+    assert(*t.select(i)==left[i]);
+    assert(t.rank(left[i])==i);
+  }
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,SortedCountingTraits> u;
+  set<int> ref;
+  checkInsertBatch(u,ref);
+  for(int x:ref) assert(*u.select(u.rank(x))==x);
+}
+
+template <class X> struct WideLeafTraits : CashewSetTraits<X> {
+  static constexpr bool wide_leaves = true;
+};
+struct WideCountingTraits : WideLeafTraits<int32_t> {
+  static constexpr bool track_subtree_counts = true;
+};
+struct WideBranchlessTraits : WideLeafTraits<int32_t> {
+  static constexpr bool branchless_node_search = true;
+};
+
+// Random inserts and erases of keys below range, checked against std::set.
+// Leaves fill up past elt_count_max, split, and shrink back down again.
+template <class X, class Less, class Traits> void checkWideLeaves(int range) {
+  cashew_set<X,Less,equal_to<X>,Traits> s;
+  set<X,Less> expected;
+  vector<int> v(4*range);
+  for(int i=0;i<v.size();++i) v[i]=i%range;
+  random_shuffle(v.begin(),v.end());
+  for(int i=0;i<v.size();++i)
+    if(i%4) assert(s.insert(X(v[i]))==expected.insert(X(v[i])).second);
+    else assert(s.erase(X(v[i]))==expected.erase(X(v[i])));
+  assert(s.size()==expected.size());
+  assert(equal(expected.begin(),expected.end(),s.begin()));
+  assert(equal(expected.rbegin(),expected.rend(),
+               reverse_iterator<decltype(s.end())>(s.end())));
+  for(int i=0;i<range;++i) assert(s.count(X(i))==expected.count(X(i)));
+  for(int x:v) s.erase(X(x));
+  assert(s.empty() && s.begin()==s.end());
+}
+
+void testWideLeaves() {
+  using node_type = CashewSetNode<int32_t,WideLeafTraits<int32_t>>;
+  static_assert(sizeof(node_type)==64, "Wide leaves are still one line");
+  if(sizeof(void*)==8) {
+    assert(node_type::leaf_elt_count_max==15);
+    assert((CashewSetNode<uint8_t,WideLeafTraits<uint8_t>>
+            ::leaf_elt_count_max==63));
+  }
+  checkWideLeaves<int32_t,less<int32_t>,WideLeafTraits<int32_t>>(30000);
+  checkWideLeaves<int32_t,greater<int32_t>,WideLeafTraits<int32_t>>(30000);
+  checkWideLeaves<int32_t,less<int32_t>,WideBranchlessTraits>(30000);
+  checkWideLeaves<uint8_t,less<uint8_t>,WideLeafTraits<uint8_t>>(256);
+  checkWideLeaves<uint16_t,less<uint16_t>,WideLeafTraits<uint16_t>>(30000);
+  checkWideLeaves<uint64_t,less<uint64_t>,WideLeafTraits<uint64_t>>(30000);
+  const CashewSearchTier best = cashew_search_tier();
+  assert(cashew_force_search_tier(CashewSearchTier::scalar));
+  checkWideLeaves<int32_t,less<int32_t>,WideLeafTraits<int32_t>>(30000);
+  assert(cashew_force_search_tier(best));
+
+  // Bulk loads fill leaves all the way, and later inserts and erases still
+  // work on top of that.
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,WideCountingTraits> s;
+  vector<int> v(20000);
+  for(int i=0;i<v.size();++i) v[i]=2*i;
+  s.assign_sorted(v.begin(),v.end());
+  for(int i=0;i<v.size();i+=3) s.insert(v[i]+1);
+  for(int i=0;i<v.size();i+=5) s.erase(v[i]);
+  vector<int> left;
+  for(int i=0;i<v.size();++i) {
+    if(i%5) left.push_back(v[i]);
+    if(i%3==0) left.push_back(v[i]+1);
+  }
+  assert(equal(left.begin(),left.end(),s.begin()) && s.size()==left.size());
+  for(int i=0;i<left.size();i+=37) {
+    assert(*s.select(i)==left[i]);
+    assert(s.rank(left[i])==i);
+  }
+  cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,WideCountingTraits> t;
+  set<int> ref;
+  checkInsertBatch(t,ref);
+  for(int x:ref) assert(*t.select(t.rank(x))==x);
+}
+
 struct IntNoDefaultCtor {
   int32_t x;
   IntNoDefaultCtor() = delete;
@@ -96,6 +591,7 @@ void testNoDefaultConstructor() {
   s.insert(IntNoDefaultCtor(4));
   assert(s.count(IntNoDefaultCtor(4))==1);
   assert(s.count(IntNoDefaultCtor(5))==0);
+  assert(s.begin()->x==4);
 }
 
 struct IntLifeCount {
@@ -129,7 +625,213 @@ void testDtorInvocation() {
     s.clear();
   }
   assert(IntLifeCount::born == IntLifeCount::died);
+  testSmallErases<IntLifeCount>();
+  assert(IntLifeCount::born == IntLifeCount::died);
+  // Wide leaves construct and destroy elements in place of family.
+  {
+    cashew_set<IntLifeCount,less<IntLifeCount>,equal_to<IntLifeCount>,
+               WideLeafTraits<IntLifeCount>> s;
+    for(int i=0;i<2000;++i) s.insert(IntLifeCount(i*7%2000));
+    for(int i=0;i<2000;i+=3) s.erase(IntLifeCount(i));
+    assert(s.size()==1333);
+  }
+  assert(IntLifeCount::born == IntLifeCount::died);
+}
+
+// Compares IntLifeCount with plain ints, so that lookups need not make one.
+struct LifeCountLess {
+  using is_transparent = void;
+  bool operator()(const IntLifeCount& a, const IntLifeCount& b) const {
+    return a.x<b.x;
+  }
+  bool operator()(const IntLifeCount& a, int32_t b) const { return a.x<b; }
+  bool operator()(int32_t a, const IntLifeCount& b) const { return a<b.x; }
+};
+struct LifeCountEq {
+  using is_transparent = void;
+  bool operator()(const IntLifeCount& a, const IntLifeCount& b) const {
+    return a.x==b.x;
+  }
+  bool operator()(const IntLifeCount& a, int32_t b) const { return a.x==b; }
+};
+
+void testTransparentLookup() {
+  cashew_set<IntLifeCount,LifeCountLess,LifeCountEq> s;
+  for(int i=0;i<3000;i+=2) s.insert(IntLifeCount(i));
+  const int born = IntLifeCount::born;
+  for(int i=-1;i<=3000;++i) {
+    const bool in = i>=0 && i<3000 && i%2==0;
+    assert(s.count(i)==in);
+    auto it = s.find(i);
+    assert(in ? it->x==i : it==s.end());
+    auto lb = s.lower_bound(i), ub = s.upper_bound(i);
+    auto range = s.equal_range(i);
+    assert(range.first==lb && range.second==ub);
+    if(i>=2998) assert(ub==s.end());
+    else assert(ub->x==(i<0 ? 0 : i/2*2+2));
+    if(i>=2999) assert(lb==s.end());
+    else assert(lb->x==(i<0 ? 0 : (i+1)/2*2));
+  }
+  assert(IntLifeCount::born==born);
+  // Keys already there are found on the way down, without copying them.
+  const IntLifeCount x(100);
+  assert(!s.insert(x) && IntLifeCount::born==born+1);
+  // So does erase.
+  for(int i=0;i<3000;i+=3) assert(s.erase(i)==(i%2==0));
+  assert(IntLifeCount::born==born+1 && s.size()==1000);
+  for(int i=0;i<3000;++i) assert(s.count(i)==(i%2==0 && i%3!=0));
+#if __cplusplus >= 201402L
+  // The SIMD kernels only take std::less<Elt>, so this goes through the
+  // scalar loop.
+  cashew_set<int64_t,less<>,equal_to<>> t;
+  for(int64_t i=0;i<1000;++i) t.insert(i<<33);
+  assert(t.count(int8_t(0))==1 && t.count(int16_t(1))==0);
+  assert(*t.lower_bound(1)==int64_t(1)<<33);
+#endif
+}
+
+// Can't be copied. Moving leaves x at -1, so that the test can tell when a
+// key was moved from.
+struct IntMoveOnly {
+  int32_t x;
+  explicit IntMoveOnly(int32_t x) : x(x) {}
+  IntMoveOnly(const IntMoveOnly&) = delete;
+  IntMoveOnly(IntMoveOnly&& that) : x(that.x) { that.x = -1; }
+  IntMoveOnly& operator=(IntMoveOnly&& that) {
+    x = that.x;
+    that.x = -1;
+    return *this;
+  }
+};
+bool operator<(const IntMoveOnly& a,const IntMoveOnly& b) { return a.x<b.x; }
+bool operator==(const IntMoveOnly& a,const IntMoveOnly& b) {
+  return a.x==b.x;
+}
+
+void testMoveInsert() {
+  cashew_set<IntMoveOnly> s;
+  for(int i=0;i<3000;++i) {
+    IntMoveOnly x(i*7%3000);
+    assert(s.insert(std::move(x)) && x.x==-1);
+  }
+  for(int i=0;i<3000;i+=5) {
+    // Duplicates leave the key alone.
+    IntMoveOnly x(i);
+    assert(!s.insert(std::move(x)) && x.x==i);
+    assert(!s.emplace(i));
+  }
+  for(int i=3000;i<4000;++i) assert(s.emplace(i));
+  for(int i=0;i<4000;i+=2) assert(s.erase(IntMoveOnly(i))==1);
+  assert(s.size()==2000);
+  int expected = 1;
+  for(auto& x : s) {
+    assert(x.x==expected);
+    expected += 2;
+  }
+  // Without splits, the set builds its own copy straight from the argument.
+  {
+    cashew_set<IntLifeCount> t;
+    const IntLifeCount y(1);
+    int born = IntLifeCount::born;
+    assert(t.insert(y) && IntLifeCount::born==born+1);
+    born = IntLifeCount::born;
+    assert(t.insert(IntLifeCount(2)) && IntLifeCount::born==born+2);
+    born = IntLifeCount::born;
+    assert(t.emplace(3) && IntLifeCount::born==born+2);
+  }
+  assert(IntLifeCount::born == IntLifeCount::died);
+}
+
+// Stateful, like the tracking allocators people plug in. All copies share
+// one count of live families.
+template <class T> struct TrackingAllocator {
+  using value_type = T;
+  size_t* live;
+  explicit TrackingAllocator(size_t* live) : live(live) {}
+  template <class U>
+    TrackingAllocator(const TrackingAllocator<U>& that) : live(that.live) {}
+  T* allocate(size_t n) {
+    void* p = aligned_alloc(alignof(T),n*sizeof(T));
+    if(p==nullptr) throw bad_alloc();
+    *live += n;
+    return static_cast<T*>(p);
+  }
+  void deallocate(T* p, size_t n) {
+    *live -= n;
+    free(p);
+  }
+};
+template <class T, class U> bool operator==(const TrackingAllocator<T>& a,
+                                            const TrackingAllocator<U>& b) {
+  return a.live==b.live;
+}
+template <class T, class U> bool operator!=(const TrackingAllocator<T>& a,
+                                            const TrackingAllocator<U>& b) {
+  return !(a==b);
+}
+
+void testCustomAllocator() {
+  using trackedSet = cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,
+        CashewSetTraits<int32_t>,TrackingAllocator<int32_t>>;
+  size_t live = 0;
+  {
+    trackedSet s{TrackingAllocator<int32_t>(&live)};
+    assert(s.get_allocator().live==&live);
+    set<int32_t> expected;
+    for(int i=0;i<20000;++i) {
+      s.insert(i*7919%20011);
+      expected.insert(i*7919%20011);
+    }
+    assert(live>0);
+    for(int i=0;i<20000;i+=2) {
+      s.erase(i);
+      expected.erase(i);
+    }
+    assert(s.size()==expected.size());
+    assert(equal(s.begin(),s.end(),expected.begin()));
+    s.clear();
+    assert(live==0);
+    for(int i=0;i<1000;++i) s.insert(i);
+  }
+  assert(live==0);
+}
+
+#if __cplusplus >= 201703L
+// Checks that every family comes out of the given memory resource, suitably
+// aligned.
+struct CountingResource : pmr::memory_resource {
+  size_t nbytes = 0;
+  pmr::monotonic_buffer_resource upstream;
+  void* do_allocate(size_t n, size_t align) override {
+    assert(align==CashewSetTraits<int32_t>::cache_line_nbytes);
+    nbytes += n;
+    return upstream.allocate(n,align);
+  }
+  void do_deallocate(void* p, size_t n, size_t align) override {
+    nbytes -= n;
+    upstream.deallocate(p,n,align);
+  }
+  bool do_is_equal(const memory_resource& that) const noexcept override {
+    return this==&that;
+  }
+};
+
+void testPmrAllocator() {
+  using pmrSet = cashew_set<int32_t,less<int32_t>,equal_to<int32_t>,
+        CashewSetTraits<int32_t>,pmr::polymorphic_allocator<int32_t>>;
+  CountingResource resource;
+  {
+    pmrSet s(&resource);
+    for(int i=0;i<20000;++i) s.insert(i*7919%20011);
+    assert(resource.nbytes>0);
+    assert(s.size()==20000);
+    for(int i=0;i<20000;++i) assert(s.count(i*7919%20011)==1);
+  }
+  assert(resource.nbytes==0);
 }
+#else
+void testPmrAllocator() {}
+#endif
 
 int main() {
   testNodeAlignment();
@@ -137,6 +839,30 @@ int main() {
   testSmallInserts<uint16_t>();
   testSmallInserts<uint32_t>();
   testSmallInserts<uint64_t>();
+  testSmallErases<uint8_t>();
+  testSmallErases<uint16_t>();
+  testSmallErases<uint32_t>();
+  testSmallErases<uint64_t>();
+  testRandomErases();
+  testRandomInsertErase();
+  testIteration<uint8_t>();
+  testIteration<uint16_t>();
+  testIteration<uint32_t>();
+  testIteration<uint64_t>();
+  testRandomIteration();
+  testBounds();
+  testOrderStatistics();
+  testAssignSorted();
+  testInsertBatch();
+  testCountBatch();
+  testSearchTiers();
+  testBranchlessSearch();
+  testSortedWithinNode();
+  testWideLeaves();
   testNoDefaultConstructor();
   testDtorInvocation();
+  testTransparentLookup();
+  testMoveInsert();
+  testCustomAllocator();
+  testPmrAllocator();
 }
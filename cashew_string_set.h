@@ -0,0 +1,393 @@
+/* A set of strings. cashew_set<std::string> would fit a single 32-byte
+   std::string in each node, and follow a pointer for most comparisons.
+
+   Here, nodes hold 8-byte CashewStringKey elements instead, 6 to a node, or
+   7 with compact family refs. Each holds the first 4 bytes of its string,
+   and a 32-bit ref to the whole string, which lives in an arena owned by the
+   set, along with its length. The 4 bytes are packed big-endian, so
+   comparing them as integers orders strings the same way memcmp() would.
+   Only strings that start with the same 4 bytes need to look at the rest.
+   Node searches compare the prefixes of a whole node at once, with the same
+   vector kernels as cashew_set<uint64_t>, and only go to the arena for
+   elements whose prefix ties with the key.
+
+   Lookups take a CashewStringView, which carries the length and a pointer to
+   the bytes as well, so that they never copy the key. Iterators hand out
+   views into the arena.
+
+   Strings are copied into the arena once, when inserted. Erasing a string
+   does not give its bytes back: they are only released by clear(), or by
+   compact(), which copies what's left into a fresh arena. This suits
+   deduplication, where strings mostly get added.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cashew_set.h"
+
+namespace cashew {
+
+class CashewStringView {
+ public:
+  CashewStringView() : prefix_(0), size_(0), data_(nullptr) {}
+  // Does not copy s, which has to outlive the view. Throws std::length_error
+  // on strings of 4 GB or more.
+  CashewStringView(const char* s, size_t n)
+      : prefix_(prefix_of(s,n)), size_(n), data_(s) {
+    if(n>UINT32_MAX) throw std::length_error("CashewStringView");
+  }
+  // For when the prefix is already known. It has to be prefix_of(s,n).
+  CashewStringView(const char* s, uint32_t n, uint32_t prefix)
+      : prefix_(prefix), size_(n), data_(s) {}
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  uint32_t prefix() const { return prefix_; }
+  std::string str() const { return std::string(data_,size_); }
+  // The first 4 bytes of s, big-endian, padded with zeros.
+  static uint32_t prefix_of(const char* s, size_t n) {
+    uint32_t rv = 0;
+    for(size_t i=0;i<4;++i)
+      rv = rv<<8 | (i<n ? static_cast<unsigned char>(s[i]) : 0);
+    return rv;
+  }
+  // Negative, zero or positive, like memcmp(), with shorter strings ordered
+  // before longer ones that start with them.
+  friend int compare(const CashewStringView& a, const CashewStringView& b) {
+    if(a.prefix_!=b.prefix_) return a.prefix_<b.prefix_ ? -1 : 1;
+    // The first 4 bytes, or all of a shorter string, are known to be equal.
+    const uint32_t n = a.size_<b.size_ ? a.size_ : b.size_;
+    if(n>4) {
+      const int c = std::memcmp(a.data_+4,b.data_+4,n-4);
+      if(c!=0) return c;
+    }
+    return a.size_<b.size_ ? -1 : a.size_>b.size_;
+  }
+  friend bool operator==(const CashewStringView& a, const CashewStringView& b) {
+    return a.prefix_==b.prefix_ && a.size_==b.size_ &&
+      (a.size_<=4 || std::memcmp(a.data_+4,b.data_+4,a.size_-4)==0);
+  }
+ private:
+  uint32_t prefix_;
+  uint32_t size_;
+  const char* data_;
+};
+
+// What the set keeps in its nodes. ref is only meaningful to the arena that
+// handed it out. On little-endian hosts, the key read as a uint64_t has the
+// prefix in its high half, which is what the node search relies on. The
+// alignment lines keys up with the search's 64-bit lanes.
+class alignas(8) CashewStringKey {
+ public:
+  CashewStringKey() : ref_(0), prefix_(0) {}
+  CashewStringKey(uint32_t ref, uint32_t prefix) : ref_(ref), prefix_(prefix) {}
+  uint32_t ref() const { return ref_; }
+  uint32_t prefix() const { return prefix_; }
+ private:
+  uint32_t ref_;
+  uint32_t prefix_;
+};
+
+// Bump allocator for strings, each stored after its 4-byte length. Chunks
+// are only freed all at once. A ref names a chunk in its high 16 bits, and
+// an offset into it in the low 16, so strings bigger than a chunk get a
+// chunk of their own, starting at offset 0.
+class CashewStringArena {
+ public:
+  static constexpr size_t chunk_nbytes = 64*1024;
+  static constexpr size_t max_chunks = 64*1024;
+  // Copies s, and returns its ref. Throws std::length_error once there are
+  // max_chunks chunks, which is 4 GB of small strings.
+  uint32_t add(const char* s, size_t n);
+  // Takes back the string added last.
+  void unadd(uint32_t ref);
+  CashewStringView view(const CashewStringKey& key) const {
+    const char* p = chunks_[key.ref()>>16].get()+(key.ref()&0xffff);
+    uint32_t n;
+    std::memcpy(&n,p,sizeof(n));
+    return CashewStringView(p+sizeof(n),n,key.prefix());
+  }
+  void clear() noexcept {
+    chunks_.clear();
+    cur_ = 0;
+    next_ = end_ = nullptr;
+    nbytes_ = 0;
+  }
+  void swap(CashewStringArena& that) noexcept {
+    chunks_.swap(that.chunks_);
+    std::swap(cur_,that.cur_);
+    std::swap(next_,that.next_);
+    std::swap(end_,that.end_);
+    std::swap(nbytes_,that.nbytes_);
+  }
+  size_t nbytes() const noexcept { return nbytes_; }
+ private:
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  size_t cur_ = 0;  // The chunk that next_ points into.
+  char* next_ = nullptr;
+  char* end_ = nullptr;
+  size_t nbytes_ = 0;
+  size_t addChunk(size_t n) {
+    if(chunks_.size()>=max_chunks)
+      throw std::length_error("CashewStringArena is full");
+    chunks_.emplace_back(new char[n]);
+    nbytes_ += n;
+    return chunks_.size()-1;
+  }
+};
+
+inline uint32_t CashewStringArena::add(const char* s, size_t n) {
+  if(n>UINT32_MAX) throw std::length_error("CashewStringArena");
+  const uint32_t n32 = n;
+  const size_t m = sizeof(n32)+n;
+  size_t chunk;
+  char* p;
+  if(m>chunk_nbytes) {
+    // Leaves the current chunk alone, so that small strings can keep using
+    // it.
+    chunk = addChunk(m);
+    p = chunks_[chunk].get();
+  }else {
+    if(m>size_t(end_-next_)) {
+      cur_ = addChunk(chunk_nbytes);
+      next_ = chunks_[cur_].get();
+      end_ = next_+chunk_nbytes;
+    }
+    chunk = cur_;
+    p = next_;
+    next_ += m;
+  }
+  std::memcpy(p,&n32,sizeof(n32));
+  if(n>0) std::memcpy(p+sizeof(n32),s,n);
+  return uint32_t(chunk<<16 | size_t(p-chunks_[chunk].get()));
+}
+
+inline void CashewStringArena::unadd(uint32_t ref) {
+  const size_t chunk = ref>>16;
+  if(chunk!=cur_ || next_==nullptr) {
+    // A chunk of its own, which is the last one added.
+    nbytes_ -= sizeof(uint32_t)+view(CashewStringKey(ref,0)).size();
+    chunks_.pop_back();
+  }else next_ = chunks_[chunk].get()+(ref&0xffff);
+}
+
+// Comparisons between keys, and views of strings to look up. Keys are
+// resolved through the arena, but only when their prefixes tie.
+class CashewStringCompare {
+ public:
+  using is_transparent = void;
+  explicit CashewStringCompare(const CashewStringArena* arena = nullptr)
+      : arena_(arena) {}
+  CashewStringView view(const CashewStringKey& key) const {
+    return arena_->view(key);
+  }
+  const CashewStringView& view(const CashewStringView& v) const { return v; }
+  // Negative, zero or positive, like compare() on views.
+  template <class A, class B> int compare3(const A& a, const B& b) const {
+    if(a.prefix()!=b.prefix()) return a.prefix()<b.prefix() ? -1 : 1;
+    return compare(view(a),view(b));
+  }
+ private:
+  const CashewStringArena* arena_;
+};
+
+struct CashewStringLess : CashewStringCompare {
+  using CashewStringCompare::CashewStringCompare;
+  template <class A, class B> bool operator()(const A& a, const B& b) const {
+    return compare3(a,b)<0;
+  }
+};
+
+struct CashewStringEq : CashewStringCompare {
+  using CashewStringCompare::CashewStringCompare;
+  template <class A, class B> bool operator()(const A& a, const B& b) const {
+    return a.prefix()==b.prefix() && view(a)==view(b);
+  }
+};
+
+// Counts elements with a smaller prefix than key, and those that tie with
+// it, using the uint64_t kernels on the whole line. Elements read as
+// uint64_t values have their prefix in the high half, so the ties are
+// exactly those in [prefix<<32, prefix<<32|0xffffffff]. Nodes without ties,
+// which is most of them, never touch the arena. Otherwise, each element
+// takes a single compare3(), which only reads the bytes of ties.
+template <class Traits>
+struct CashewNodeSearch<CashewStringKey,CashewStringLess,CashewStringEq,
+                        Traits> {
+  using elt_count_type = typename Traits::elt_count_type;
+  template <class Node, class Key>
+  static elt_count_type find(const Node& node, const Key& key,
+                             const CashewStringLess& less,
+                             const CashewStringEq&,
+                             elt_count_type& lessCount) {
+#if CASHEW_X86_DISPATCH
+    static_assert(sizeof(CashewStringKey)==sizeof(int64_t) &&
+                  alignof(CashewStringKey)==alignof(int64_t),
+        "Keys are searched as 64-bit lanes");
+    const CashewSearchTier tier = cashew_search_tier();
+    if(tier!=CashewSearchTier::scalar) {
+      const uint64_t lo = uint64_t(key.prefix())<<32;
+      const int64_t bias = std::numeric_limits<int64_t>::min();
+      int below, belowHi;
+      cashew_node_find_lanes(tier,node,int64_t(lo),bias,below);
+      const int atHi =
+        cashew_node_find_lanes(tier,node,int64_t(lo|0xffffffff),bias,belowHi);
+      if(belowHi-below+(atHi>=0)==0) {
+        lessCount = below;
+        return -1;
+      }
+    }
+#endif
+    lessCount = 0;
+    for(elt_count_type i=0;i<node.elt_count();++i) {
+      const int c = less.compare3(node.elt(i),key);
+      if(c==0) return i;
+      lessCount += c<0;
+    }
+    return -1;
+  }
+};
+
+template <class Traits = CashewSetTraits<CashewStringKey>,
+          class Alloc = CashewDefaultAllocator<CashewStringKey,Traits>>
+class cashew_string_set {
+  using set_type = cashew_set<CashewStringKey,CashewStringLess,
+                              CashewStringEq,Traits,Alloc>;
+ public:
+  using key_type = CashewStringView;
+  using value_type = key_type;
+  using size_type = size_t;
+  using allocator_type = Alloc;
+  cashew_string_set()
+      : keys(CashewStringLess(&arena),CashewStringEq(&arena)) {}
+  explicit cashew_string_set(const Alloc& a)
+      : keys(CashewStringLess(&arena),CashewStringEq(&arena),a) {}
+  allocator_type get_allocator() const { return keys.get_allocator(); }
+
+  // Dereferences to a CashewStringView of the set's own copy.
+  class const_iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = CashewStringView;
+    using difference_type = ptrdiff_t;
+    using pointer = const CashewStringView*;
+    using reference = CashewStringView;
+    const_iterator() : arena_(nullptr) {}
+    CashewStringView operator*() const { return arena_->view(*it_); }
+    const CashewStringView* operator->() const {
+      view_ = **this;
+      return &view_;
+    }
+    const_iterator& operator++() { ++it_; return *this; }
+    const_iterator& operator--() { --it_; return *this; }
+    const_iterator operator++(int) { const_iterator rv=*this; ++it_; return rv; }
+    const_iterator operator--(int) { const_iterator rv=*this; --it_; return rv; }
+    bool operator==(const const_iterator& that) const { return it_==that.it_; }
+    bool operator!=(const const_iterator& that) const { return it_!=that.it_; }
+   private:
+    friend class cashew_string_set;
+    const_iterator(typename set_type::const_iterator it,
+                   const CashewStringArena* arena) : it_(it), arena_(arena) {}
+    typename set_type::const_iterator it_;
+    const CashewStringArena* arena_;
+    mutable CashewStringView view_;
+  };
+  using iterator = const_iterator;
+
+  const_iterator begin() const { return wrap(keys.begin()); }
+  const_iterator end() const { return wrap(keys.end()); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  size_type size() const noexcept { return keys.size(); }
+  bool empty() const noexcept { return keys.empty(); }
+  void clear() noexcept {
+    keys.clear();
+    arena.clear();
+  }
+  // Bytes taken by copies of strings, including those already erased, until
+  // the next clear() or compact().
+  size_type arena_nbytes() const noexcept { return arena.nbytes(); }
+  // Copies the strings still in the set into a fresh arena, and drops the old
+  // one, along with the bytes of every string erased so far. Takes O(size())
+  // time, and room for both arenas while it runs. Invalidates iterators.
+  // Provides basic exception safety: may leave the set empty.
+  void compact();
+
+  bool insert(const char* s, size_type n);
+  bool insert(const std::string& s) { return insert(s.data(),s.size()); }
+  size_type count(const char* s, size_type n) const {
+    return keys.count(key_type(s,n));
+  }
+  size_type count(const std::string& s) const {
+    return count(s.data(),s.size());
+  }
+  // Returns the number of strings removed: 0 or 1. The string's bytes stay
+  // in the arena, see arena_nbytes().
+  size_type erase(const char* s, size_type n) {
+    return keys.erase(key_type(s,n));
+  }
+  size_type erase(const std::string& s) { return erase(s.data(),s.size()); }
+  const_iterator find(const char* s, size_type n) const {
+    return wrap(keys.find(key_type(s,n)));
+  }
+  const_iterator find(const std::string& s) const {
+    return find(s.data(),s.size());
+  }
+  // First string not less than s.
+  const_iterator lower_bound(const std::string& s) const {
+    return wrap(keys.lower_bound(key_type(s.data(),s.size())));
+  }
+  // First string greater than s.
+  const_iterator upper_bound(const std::string& s) const {
+    return wrap(keys.upper_bound(key_type(s.data(),s.size())));
+  }
+
+ private:
+  // Declared first, since keys compare through it.
+  CashewStringArena arena;
+  set_type keys;
+  const_iterator wrap(typename set_type::const_iterator it) const {
+    return const_iterator(it,&arena);
+  }
+};
+
+// Copies s into the arena up front, so that the tree is only walked once.
+// Duplicates then hand the copy straight back.
+template <class Traits, class Alloc>
+bool cashew_string_set<Traits,Alloc>::insert(const char* s, size_type n) {
+  const uint32_t ref = arena.add(s,n);
+  bool rv;
+  try {
+    rv = keys.insert(CashewStringKey(ref,key_type::prefix_of(s,n)));
+  }catch(...) {
+    arena.unadd(ref);
+    throw;
+  }
+  if(!rv) arena.unadd(ref);
+  return rv;
+}
+
+// Keys come out in order, and refs don't change how they compare, so the
+// tree can be rebuilt without sorting.
+template <class Traits, class Alloc>
+void cashew_string_set<Traits,Alloc>::compact() {
+  CashewStringArena fresh;
+  std::vector<CashewStringKey> moved;
+  moved.reserve(size());
+  for(const CashewStringKey& key : keys) {
+    const CashewStringView v = arena.view(key);
+    moved.push_back(CashewStringKey(fresh.add(v.data(),v.size()),
+                                    key.prefix()));
+  }
+  arena.swap(fresh);
+  keys.assign_sorted(moved.begin(),moved.end());
+}
+
+}  // namespace cashew
@@ -0,0 +1,172 @@
+#include "cashew_string_set.h"
+#include <cassert>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace cashew;
+using namespace std;
+
+void testNodeLayout() {
+  static_assert(sizeof(CashewStringKey)==8, "String keys should be 8 bytes");
+  assert(CashewSetTraits<CashewStringKey>::elt_count_max>=6);
+}
+
+// Strings that tie on their first 4 bytes, or differ only in length or in
+// bytes that memcmp() and char comparisons disagree on.
+void testCompare() {
+  const vector<string> v = {"", string(1,'\0'), string(2,'\0'), "a", "ab",
+    string("ab\0",3), string("ab\0\0",4), string("ab\0\0\0",5), "abcd",
+    "abcde", "abcdf", "abce", "b", "\x7f", "\x80", "\xff", "\xff\xff\xff\xff",
+    string("\xff\xff\xff\xff\0",5)};
+  for(auto& a : v) for(auto& b : v) {
+    const CashewStringView x(a.data(),a.size()), y(b.data(),b.size());
+    const int c = compare(x,y);
+    assert((c<0)==(a<b) && (c>0)==(a>b) && (x==y)==(a==b));
+  }
+}
+
+void testBasicOps() {
+  cashew_string_set<> s;
+  assert(s.empty() && s.count("")==0 && s.begin()==s.end());
+  assert(s.insert("hello") && !s.insert(string("hello")));
+  assert(s.insert("") && !s.insert(""));
+  assert(s.insert("help") && s.insert("hell"));
+  assert(s.size()==4 && s.count("hell")==1 && s.count("he")==0);
+  auto it = s.begin();
+  assert(it->str()=="" && (++it)->str()=="hell");
+  assert((++it)->str()=="hello" && (++it)->str()=="help" && ++it==s.end());
+  assert(s.lower_bound("hellp")->str()=="help");
+  assert(s.upper_bound("hell")->str()=="hello");
+  assert(s.find("help")->str()=="help" && s.find("helps")==s.end());
+  assert(s.erase("hell")==1 && s.erase("hell")==0 && s.count("hell")==0);
+  s.clear();
+  assert(s.empty() && s.arena_nbytes()==0 && s.count("hello")==0);
+  // The arena starts over: a duplicate gives its bytes straight back.
+  const string big(2*CashewStringArena::chunk_nbytes,'b');
+  assert(s.insert("hello") && s.insert(big));
+  const size_t nbytes = s.arena_nbytes();
+  assert(!s.insert(big) && !s.insert("hello") && s.arena_nbytes()==nbytes);
+  assert(s.count("hello")==1 && s.count(big)==1 && s.size()==2);
+}
+
+// URL-like strings share long prefixes, so most comparisons go past the
+// first 4 bytes.
+void testAgainstStdSet() {
+  minstd_rand rng(22);
+  const char* hosts[] = {"https://example.com/", "https://example.org/",
+                         "http://a.io/", "www.", ""};
+  cashew_string_set<> s;
+  set<string> ref;
+  for(int i=0;i<100000;++i) {
+    string x = hosts[rng()%5];
+    for(int n=rng()%12;n>0;--n) x += char('a'+rng()%4);
+    if(rng()%4) assert(s.insert(x)==ref.insert(x).second);
+    else assert(s.erase(x)==ref.erase(x));
+  }
+  assert(s.size()==ref.size());
+  auto it = ref.begin();
+  for(auto k : s) assert(k.str()==*it++);
+  for(auto& x : ref) {
+    assert(s.count(x)==1);
+    assert(s.count(x+"a")==ref.count(x+"a"));
+  }
+  // Duplicates don't use up arena space.
+  const size_t nbytes = s.arena_nbytes();
+  for(auto& x : ref) assert(!s.insert(x));
+  assert(s.arena_nbytes()==nbytes);
+}
+
+// The set keeps its own copies, so the caller's strings can go away.
+void testOwnership() {
+  cashew_string_set<> s;
+  {
+    vector<string> v;
+    for(int i=0;i<1000;++i) v.push_back(string(i%300,'x')+to_string(i));
+    for(auto& x : v) assert(s.insert(x));
+  }
+  for(int i=0;i<1000;++i)
+    assert(s.count(string(i%300,'x')+to_string(i))==1);
+  // Strings bigger than a chunk get a chunk of their own.
+  string big(3*CashewStringArena::chunk_nbytes,'q');
+  assert(s.insert(big) && s.count(big)==1 && !s.insert(big));
+  big.back() = 'r';
+  assert(s.count(big)==0);
+  // A duplicate big string gives its chunk straight back.
+  const size_t nbytes = s.arena_nbytes();
+  big.back() = 'q';
+  assert(!s.insert(big) && s.arena_nbytes()==nbytes);
+}
+
+struct WideLeafTraits : CashewSetTraits<CashewStringKey> {
+  static constexpr bool wide_leaves = true;
+};
+
+// Many strings tie on their first 4 bytes, so that node searches fall back
+// to the arena, in nodes that also hold strings with other prefixes.
+template <class Traits> void checkPrefixTies() {
+  minstd_rand rng(7);
+  const char* prefixes[] = {"aaaa", "aaab", "aab", "", "\xff\xff\xff\xff"};
+  cashew_string_set<Traits> s;
+  set<string> ref;
+  for(int i=0;i<20000;++i) {
+    string x = prefixes[rng()%5];
+    for(int n=rng()%3;n>0;--n) x += char(rng()%3);
+    if(rng()%3) assert(s.insert(x)==ref.insert(x).second);
+    else assert(s.erase(x)==ref.erase(x));
+    assert(s.count(x)==ref.count(x));
+  }
+  for(auto& x : ref) {
+    assert(s.find(x)->str()==x);
+    auto lb = ref.lower_bound(x+'\0'), ub = ref.upper_bound(x+'\0');
+    assert(lb==ref.end() ? s.lower_bound(x+'\0')==s.end()
+                         : s.lower_bound(x+'\0')->str()==*lb);
+    assert(ub==ref.end() ? s.upper_bound(x+'\0')==s.end()
+                         : s.upper_bound(x+'\0')->str()==*ub);
+  }
+}
+
+void testPrefixTies() {
+  const CashewSearchTier best = cashew_search_tier();
+  for(auto tier : {CashewSearchTier::scalar,CashewSearchTier::sse42,
+                   CashewSearchTier::avx2,CashewSearchTier::avx512}) {
+    if(!cashew_force_search_tier(tier)) continue;
+    checkPrefixTies<CashewSetTraits<CashewStringKey>>();
+    checkPrefixTies<WideLeafTraits>();
+  }
+  assert(cashew_force_search_tier(best));
+}
+
+// Erased strings keep their bytes until compact().
+void testCompact() {
+  cashew_string_set<> s;
+  s.compact();
+  assert(s.empty());
+  vector<string> v;
+  for(int i=0;i<50000;++i) v.push_back("key"+to_string(i*7919%50000));
+  for(auto& x : v) assert(s.insert(x));
+  assert(s.insert(string(2*CashewStringArena::chunk_nbytes,'z')));
+  const size_t full = s.arena_nbytes();
+  for(size_t i=0;i<v.size();++i) if(i%10) assert(s.erase(v[i])==1);
+  assert(s.erase(string(2*CashewStringArena::chunk_nbytes,'z'))==1);
+  assert(s.arena_nbytes()==full);
+  s.compact();
+  assert(s.size()==v.size()/10 && s.arena_nbytes()<full/5);
+  set<string> ref;
+  for(size_t i=0;i<v.size();i+=10) ref.insert(v[i]);
+  auto it = ref.begin();
+  for(auto k : s) assert(k.str()==*it++);
+  for(size_t i=0;i<v.size();++i) assert(s.count(v[i])==(i%10==0));
+  assert(s.insert("key") && !s.insert(v[0]));
+}
+
+int main() {
+  testNodeLayout();
+  testCompare();
+  testBasicOps();
+  testAgainstStdSet();
+  testOwnership();
+  testPrefixTies();
+  testCompact();
+}
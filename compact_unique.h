@@ -0,0 +1,219 @@
+// Like aligned_unique.h, but with 32-bit pointers, for 64-bit hosts where a
+// whole pointer is too much to spend in a 64-byte node. Provides:
+//   * CashewArena: One big range of address space, reserved up front and
+//       committed as needed. Anything in it can be named by a 32-bit number
+//       of 64-byte units from its start, which covers 256 GB. Process-wide
+//       and thread-safe. Address space is never released, but the pages of
+//       ranges given back are, and the ranges get reused.
+//   * CashewArenaChunks: A chunk source for CashewSlab (see slab_unique.h)
+//       that carves chunks out of CashewArena.
+//   * compact_unique_ptr<T,Deleter>: A unique_ptr lookalike that stores a
+//       uint32_t. T must live in CashewArena, 64-byte aligned.
+//
+// Only POSIX hosts are supported, since we need mmap() to reserve address
+// space without committing memory. Elsewhere, allocations just fail.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace cashew {
+
+class CashewArena {
+ public:
+  static constexpr size_t unit_nbytes = 64;
+  // All that 32 bits can reach. Capped at 1 GB on 32-bit hosts, where
+  // compact pointers don't save anything anyway.
+  static constexpr size_t max_nbytes = sizeof(size_t)>4
+    ? size_t(uint64_t(1)<<32)*unit_nbytes : size_t(1)<<30;
+
+  // Start of the arena, or nullptr if nothing was allocated yet. A plain
+  // global, since every compact_unique_ptr dereference reads it.
+  template <class Dummy=void> struct Base { static char* ptr; };
+
+  static uint32_t encode(const void* p) noexcept {
+    return p==nullptr ? 0 : uint32_t(
+        (static_cast<const char*>(p)-Base<>::ptr)/unit_nbytes);
+  }
+  // Skips the null check. Only for refs known to be non-zero.
+  static void* decodeNonNull(uint32_t ref) noexcept {
+    return Base<>::ptr+size_t(ref)*unit_nbytes;
+  }
+  static void* decode(uint32_t ref) noexcept {
+    return ref==0 ? nullptr : decodeNonNull(ref);
+  }
+
+  // Returns memory aligned to align, which has to be a power of 2 no larger
+  // than the page size. Returns nullptr if the arena is full, or address
+  // space could not be reserved.
+  static void* allocate(size_t align, size_t nbytes);
+  // Gives the pages of [p,p+nbytes) back to the system, and keeps the range
+  // for later allocate() calls of the same size. nbytes has to be what p was
+  // allocated with.
+  static void deallocate(void* p, size_t nbytes) noexcept;
+  // Bytes handed out so far, including those given back.
+  static size_t used_nbytes();
+
+ private:
+  // Written at the start of a range given back, which keeps its first page.
+  struct FreeRange {
+    FreeRange* next;
+    size_t nbytes;
+  };
+  struct State {
+    std::mutex mutex;
+    char* next = nullptr;
+    char* end = nullptr;
+    FreeRange* freed = nullptr;
+  };
+  static State& state() {
+    static State* s = new State;
+    return *s;
+  }
+  static bool reserve(State& s);
+};
+
+template <class Dummy> char* CashewArena::Base<Dummy>::ptr = nullptr;
+
+// Reserves the whole range with no access, so the kernel doesn't count it
+// against memory limits. allocate() opens it up as it goes.
+inline bool CashewArena::reserve(State& s) {
+#if defined(__unix__) || defined(__APPLE__)
+  void* p = mmap(nullptr,max_nbytes,PROT_NONE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+  if(p==MAP_FAILED) return false;
+  Base<>::ptr = static_cast<char*>(p);
+  // Unit 0 stays unused, so that ref 0 can mean nullptr.
+  s.next = Base<>::ptr+unit_nbytes;
+  s.end = Base<>::ptr+max_nbytes;
+  return true;
+#else
+  (void)s;
+  return false;
+#endif
+}
+
+inline void* CashewArena::allocate(size_t align, size_t nbytes) {
+  State& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if(Base<>::ptr==nullptr && !reserve(s)) return nullptr;
+#if defined(__unix__) || defined(__APPLE__)
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  if(align>page) return nullptr;
+  for(FreeRange** f=&s.freed;*f!=nullptr;f=&(*f)->next) {
+    if((*f)->nbytes!=nbytes || reinterpret_cast<uintptr_t>(*f)%align!=0)
+      continue;
+    FreeRange* rv = *f;
+    *f = rv->next;
+    return rv;
+  }
+  char* p = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(s.next)+align-1)/align*align);
+  if(nbytes>size_t(s.end-p)) return nullptr;
+  const uintptr_t lo = reinterpret_cast<uintptr_t>(p)/page*page;
+  const uintptr_t hi = (reinterpret_cast<uintptr_t>(p)+nbytes+page-1)
+                       / page*page;
+  if(mprotect(reinterpret_cast<void*>(lo),hi-lo,PROT_READ|PROT_WRITE)!=0)
+    return nullptr;
+  s.next = p+nbytes;
+  return p;
+#else
+  return nullptr;
+#endif
+}
+
+// Pages that p shares with its neighbours stay, and so does the first one,
+// which holds the FreeRange.
+inline void CashewArena::deallocate(void* p, size_t nbytes) noexcept {
+  State& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+#if defined(__unix__) || defined(__APPLE__)
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  const uintptr_t lo = (reinterpret_cast<uintptr_t>(p)+sizeof(FreeRange)
+                        +page-1)/page*page;
+  const uintptr_t hi = (reinterpret_cast<uintptr_t>(p)+nbytes)/page*page;
+  if(hi>lo) madvise(reinterpret_cast<void*>(lo),hi-lo,MADV_DONTNEED);
+#endif
+  if(nbytes>=sizeof(FreeRange)) s.freed = new (p) FreeRange{s.freed,nbytes};
+}
+
+inline size_t CashewArena::used_nbytes() {
+  State& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.next==nullptr ? 0 : s.next-Base<>::ptr-unit_nbytes;
+}
+
+struct CashewArenaChunks {
+  static constexpr size_t target_chunk_nbytes = 256*1024;
+  static void* allocate(size_t align, size_t nbytes) {
+    return CashewArena::allocate(align,nbytes);
+  }
+  static void deallocate(void* p, size_t nbytes) noexcept {
+    CashewArena::deallocate(p,nbytes);
+  }
+};
+
+// Supports just what cashew_set needs from a unique_ptr: moves, ->, *,
+// reset(), and comparisons with nullptr.
+template <class T, class Deleter>
+class compact_unique_ptr {
+  uint32_t ref_;
+ public:
+  compact_unique_ptr() noexcept : ref_(0) {}
+  compact_unique_ptr(std::nullptr_t) noexcept : ref_(0) {}
+  explicit compact_unique_ptr(T* p) noexcept : ref_(CashewArena::encode(p)) {}
+  compact_unique_ptr(compact_unique_ptr&& that) noexcept : ref_(that.ref_) {
+    that.ref_ = 0;
+  }
+  compact_unique_ptr& operator=(compact_unique_ptr&& that) noexcept {
+    reset(that.release());
+    return *this;
+  }
+  compact_unique_ptr& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+  ~compact_unique_ptr() { reset(); }
+
+  T* get() const noexcept {
+    return static_cast<T*>(CashewArena::decode(ref_));
+  }
+  T* operator->() const noexcept {
+    return static_cast<T*>(CashewArena::decodeNonNull(ref_));
+  }
+  T& operator*() const noexcept { return *operator->(); }
+  explicit operator bool() const noexcept { return ref_!=0; }
+  T* release() noexcept {
+    T* rv = get();
+    ref_ = 0;
+    return rv;
+  }
+  void reset(T* p = nullptr) noexcept {
+    T* old = get();
+    ref_ = CashewArena::encode(p);
+    if(old!=nullptr) Deleter()(old);
+  }
+
+  friend bool operator==(const compact_unique_ptr& p, std::nullptr_t) {
+    return p.ref_==0;
+  }
+  friend bool operator!=(const compact_unique_ptr& p, std::nullptr_t) {
+    return p.ref_!=0;
+  }
+  friend bool operator==(std::nullptr_t, const compact_unique_ptr& p) {
+    return p.ref_==0;
+  }
+  friend bool operator!=(std::nullptr_t, const compact_unique_ptr& p) {
+    return p.ref_!=0;
+  }
+};
+
+}  // namespace cashew
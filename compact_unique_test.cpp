@@ -0,0 +1,123 @@
+#include "cashew_map.h"
+#include "cashew_set.h"
+#include "compact_unique.h"
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <random>
+#include <set>
+using namespace cashew;
+using namespace std;
+
+template <class X> using CompactTraits = CashewSetTraits<X,true>;
+template <class X> struct CompactWideTraits : CompactTraits<X> {
+  static constexpr bool wide_leaves = true;
+};
+template <class X, class Traits = CompactTraits<X>> using compactSet =
+  cashew_set<X,less<X>,equal_to<X>,Traits>;
+
+void testNodeLayout() {
+  using node32 = CashewSetNode<int32_t,CompactTraits<int32_t>>;
+  using node64 = CashewSetNode<int64_t,CompactTraits<int64_t>>;
+  static_assert(sizeof(node32)==64 && sizeof(node64)==64,
+      "Compact nodes should still be one line");
+  static_assert(sizeof(node32::family_pointer_type)==4,
+      "Compact family pointers should be 32 bits");
+  if(sizeof(void*)==8) {
+    // One more element per node, either way.
+    assert(CompactTraits<int32_t>::elt_count_max==14);
+    assert(CompactTraits<int64_t>::elt_count_max==7);
+    assert(CashewSetTraits<int32_t>::elt_count_max==13);
+    assert((CashewSetNode<int32_t,CompactWideTraits<int32_t>>
+            ::leaf_elt_count_max==15));
+  }
+}
+
+struct Blob {
+  alignas(64) char x[64];
+};
+struct BlobDeleter {
+  static int count;
+  void operator()(Blob*) const noexcept { count++; }
+};
+int BlobDeleter::count = 0;
+
+void testPointer() {
+  void* mem = CashewArena::allocate(64,3*sizeof(Blob));
+  assert(mem!=nullptr && reinterpret_cast<uintptr_t>(mem)%64==0);
+  Blob* b = static_cast<Blob*>(mem);
+  using ptr = compact_unique_ptr<Blob,BlobDeleter>;
+  ptr p(&b[1]);
+  assert(p!=nullptr && p.get()==&b[1] && &*p==&b[1]);
+  ptr q(std::move(p));
+  assert(p==nullptr && p.get()==nullptr && q.get()==&b[1]);
+  q.reset(&b[2]);
+  assert(BlobDeleter::count==1 && q.get()==&b[2]);
+  p = std::move(q);
+  assert(BlobDeleter::count==1 && q==nullptr && p.get()==&b[2]);
+  p = nullptr;
+  assert(BlobDeleter::count==2);
+  assert(CashewArena::used_nbytes()>=3*sizeof(Blob));
+}
+
+// Ranges given back are handed out again, to requests of the same size.
+void testArenaReuse() {
+  const size_t nbytes = CashewArenaChunks::target_chunk_nbytes;
+  char* p = static_cast<char*>(CashewArena::allocate(64,nbytes));
+  assert(p!=nullptr);
+  p[0] = p[nbytes-1] = 1;
+  const size_t used = CashewArena::used_nbytes();
+  CashewArena::deallocate(p,nbytes);
+  char* q = static_cast<char*>(CashewArena::allocate(64,nbytes/2));
+  assert(q!=p && CashewArena::used_nbytes()>used);
+  assert(CashewArena::allocate(64,nbytes)==p);
+  p[0] = p[nbytes-1] = 2;
+}
+
+template <class X, class Traits = CompactTraits<X>> void testRandomOps() {
+  minstd_rand rng(19);
+  compactSet<X,Traits> s;
+  set<X> expected;
+  for(int i=0;i<200000;++i) {
+    X x = X(rng()%100000);
+    if(rng()%3) assert(s.insert(x)==expected.insert(x).second);
+    else assert(s.erase(x)==expected.erase(x));
+  }
+  assert(s.size()==expected.size());
+  assert(equal(s.begin(),s.end(),expected.begin()));
+  for(int i=0;i<1000;++i) assert(s.count(X(i))==expected.count(X(i)));
+  s.clear();
+  assert(s.empty() && s.begin()==s.end());
+}
+
+void testMap() {
+  cashew_map<int64_t,int,less<int64_t>,equal_to<int64_t>,CompactTraits<int64_t>>
+    m;
+  map<int64_t,int> expected;
+  for(int i=0;i<50000;++i) {
+    m[i*7919%50021] = i;
+    expected[i*7919%50021] = i;
+  }
+  for(int i=0;i<50000;i+=3) {
+    m.erase(i);
+    expected.erase(i);
+  }
+  assert(m.size()==expected.size());
+  auto it = expected.begin();
+  for(auto kv : m) {
+    assert(kv.first==it->first && kv.second==it->second);
+    ++it;
+  }
+}
+
+int main() {
+  testNodeLayout();
+  testPointer();
+  testArenaReuse();
+  testRandomOps<int32_t>();
+  testRandomOps<uint64_t>();
+  testRandomOps<uint8_t>();
+  // Compact refs leave room for one more int32_t in leaves.
+  testRandomOps<int32_t,CompactWideTraits<int32_t>>();
+  testMap();
+}
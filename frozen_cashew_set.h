@@ -0,0 +1,239 @@
+/* A read-only copy of a cashew_set, for sets that are built once and then
+   searched many times.
+
+   Keys are stored in 64-byte blocks, just like cashew_set nodes, but without
+   any pointers: the blocks form an implicit B-tree (sometimes called an
+   S-tree). Each block holds block_size sorted keys, and block k has
+   block_size+1 children, at blocks k*(block_size+1)+1 and up. Blocks are
+   numbered level by level, Eytzinger style, so the whole tree is a single
+   array. Finding a child is just arithmetic, which means there's no pointer
+   to wait on before we can prefetch the next level.
+
+   Keys are placed in the blocks by an in-order walk. The last few slots in
+   that order are padding: they hold copies of the largest key. Padding then
+   sorts after every real key, without us needing a sentinel value that is
+   larger than everything else.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "aligned_unique.h"
+#include "cashew_set.h"
+
+namespace cashew {
+
+template <class Elt, class Less = std::less<Elt>,
+          class Eq = std::equal_to<Elt>,
+          class Traits = CashewSetTraits<Elt>>
+class frozen_cashew_set {
+ public:
+  using key_type = typename Traits::key_type;
+  using value_type = key_type;
+  using size_type = size_t;
+  static constexpr size_t block_size = Traits::cache_line_nbytes/sizeof(Elt);
+  static_assert(block_size>0, "Keys don't fit in a cache line");
+
+  frozen_cashew_set() = default;
+  // [first,last) must be sorted and free of duplicates. Throws
+  // std::invalid_argument otherwise.
+  template <class ForwardIt> frozen_cashew_set(ForwardIt first, ForwardIt last);
+  template <class Alloc>
+  explicit frozen_cashew_set(const cashew_set<Elt,Less,Eq,Traits,Alloc>& s)
+    : frozen_cashew_set(s.begin(),s.end()) {}
+  frozen_cashew_set(frozen_cashew_set&& that) noexcept { swap(that); }
+  frozen_cashew_set& operator=(frozen_cashew_set&& that) noexcept {
+    swap(that);
+    return *this;
+  }
+  ~frozen_cashew_set() { destroyAll(); }
+
+  size_type size() const noexcept { return eltCount; }
+  bool empty() const noexcept { return eltCount==0; }
+  size_type count(key_type key) const {
+    const Elt* p = lower_bound(key);
+    return p!=nullptr && eq(*p,key);
+  }
+  // Same as cashew_set::count_batch(). Since children are found without
+  // loading anything, each lookup can prefetch its next block as soon as it
+  // knows which one it is.
+  size_type count_batch(const key_type* keys, size_type n,
+                        size_type* out) const;
+  // The smallest element not less than key, or nullptr if there is none.
+  // Elements are not stored in order, so there is no iterating from there.
+  const Elt* lower_bound(key_type key) const;
+  void swap(frozen_cashew_set& that) noexcept {
+    using std::swap;
+    swap(blocks,that.blocks);
+    swap(blockCount,that.blockCount);
+    swap(eltCount,that.eltCount);
+    swap(constructed,that.constructed);
+  }
+
+ private:
+  struct block_type {
+    alignas(Traits::cache_line_nbytes) char buf[block_size*sizeof(Elt)];
+  };
+  aligned_unique_ptr<block_type[]> blocks{nullptr,free_deleter<block_type[]>(0)};
+  size_type blockCount = 0;
+  size_type eltCount = 0;
+  size_type constructed = 0;  // Number of slots holding live objects.
+  Less less;
+  Eq eq;
+
+  void destroyAll() noexcept {
+    if(constructed==blockCount*block_size)
+      for(size_type i=0;i<constructed;++i) slot(i).~Elt();
+    else destroyInOrder(0);  // Half-built. See build().
+    constructed = 0;
+  }
+  void destroyInOrder(size_type k) noexcept;
+  // Slots are numbered block by block.
+  Elt& slot(size_type i) {
+    return reinterpret_cast<Elt*>(blocks[i/block_size].buf)[i%block_size];
+  }
+  const Elt* block(size_type k) const {
+    return reinterpret_cast<const Elt*>(blocks[k].buf);
+  }
+  static size_type child(size_type k, size_type i) {
+    return k*(block_size+1)+i+1;
+  }
+  // Number of keys in block k less than key. Keys are sorted within a block,
+  // but with so few of them, counting beats a binary search.
+  size_type lessCount(size_type k, const key_type& key) const {
+    const Elt* b = block(k);
+    size_type rv = 0;
+    for(size_type i=0;i<block_size;++i) rv += less(b[i],key);
+    return rv;
+  }
+  template <class ForwardIt>
+    void build(size_type k, ForwardIt& it, size_type& placed, const Elt*& prev);
+};
+
+template <class Elt, class Less, class Eq, class Traits>
+template <class ForwardIt>
+frozen_cashew_set<Elt,Less,Eq,Traits>::frozen_cashew_set(
+    ForwardIt first, ForwardIt last) {
+  eltCount = std::distance(first,last);
+  if(eltCount==0) return;
+  blockCount = (eltCount+block_size-1)/block_size;
+  blocks = make_aligned_unique<block_type[],Traits::cache_line_nbytes>(
+      blockCount);
+  size_type placed = 0;
+  const Elt* prev = nullptr;
+  try {
+    build(0,first,placed,prev);
+  }catch(...) {
+    destroyAll();
+    throw;
+  }
+}
+
+// Fills in the subtree under block k in order. Once the input runs out, the
+// remaining slots get copies of the largest element, which prev keeps
+// pointing to.
+template <class Elt, class Less, class Eq, class Traits>
+template <class ForwardIt>
+void frozen_cashew_set<Elt,Less,Eq,Traits>::build(
+    size_type k, ForwardIt& it, size_type& placed, const Elt*& prev) {
+  if(k>=blockCount) return;
+  for(size_type i=0;i<block_size;++i) {
+    build(child(k,i),it,placed,prev);
+    Elt* dest = &slot(k*block_size+i);
+    if(placed<eltCount) {
+      if(prev!=nullptr && !less(*prev,*it))
+        throw std::invalid_argument(
+            "frozen_cashew_set needs sorted, distinct input");
+      new (dest) Elt(*it);
+      ++it;
+      ++placed;
+      prev = dest;
+    }else new (dest) Elt(*prev);
+    constructed++;
+  }
+  build(child(k,block_size),it,placed,prev);
+}
+
+// Walks the same order as build(), destroying the first `constructed` slots.
+template <class Elt, class Less, class Eq, class Traits>
+void frozen_cashew_set<Elt,Less,Eq,Traits>::destroyInOrder(
+    size_type k) noexcept {
+  for(size_type i=0;i<=block_size && k<blockCount;++i) {
+    if(constructed==0) return;
+    destroyInOrder(child(k,i));
+    if(i==block_size || constructed==0) return;
+    slot(k*block_size+i).~Elt();
+    constructed--;
+  }
+}
+
+// Each block we visit narrows down the answer to something in the subtree of
+// the child we go to next, or to the first key of this block not less than
+// key. So, like cashew_set::seek(), we just keep the last candidate.
+template <class Elt, class Less, class Eq, class Traits>
+const Elt* frozen_cashew_set<Elt,Less,Eq,Traits>::lower_bound(
+    key_type key) const {
+  const Elt* rv = nullptr;
+  for(size_type k=0;k<blockCount;) {
+    const size_type i = lessCount(k,key);
+    if(i<block_size) rv = &block(k)[i];
+    k = child(k,i);
+  }
+  return rv;
+}
+
+template <class Elt, class Less, class Eq, class Traits>
+auto frozen_cashew_set<Elt,Less,Eq,Traits>::count_batch(
+    const key_type* keys, size_type n, size_type* out) const -> size_type {
+  constexpr int slot_count = Traits::lookups_in_flight;
+  size_type blk[slot_count], pos[slot_count];
+  const Elt* best[slot_count];
+  size_type next = 0, rv = 0;
+  int active = 0;
+  for(;active<slot_count && next<n;++active) {
+    blk[active] = 0;
+    best[active] = nullptr;
+    pos[active] = next++;
+  }
+  while(active>0) {
+    for(int q=0;q<active;++q) {
+      const key_type& key = keys[pos[q]];
+      if(blk[q]<blockCount) {
+        const size_type i = lessCount(blk[q],key);
+        if(i<block_size) best[q] = &block(blk[q])[i];
+        blk[q] = child(blk[q],i);
+        if(blk[q]<blockCount) prefetch_line(block(blk[q]));
+        continue;
+      }
+      const bool found = best[q]!=nullptr && eq(*best[q],key);
+      out[pos[q]] = found;
+      rv += found;
+      if(next<n) {
+        blk[q] = 0;
+        best[q] = nullptr;
+        pos[q] = next++;
+      }else {
+        --active;
+        blk[q] = blk[active];
+        best[q] = best[active];
+        pos[q] = pos[active];
+        --q;
+      }
+    }
+  }
+  return rv;
+}
+
+// Makes a frozen copy of s. s itself is left alone.
+template <class Elt, class Less, class Eq, class Traits, class Alloc>
+frozen_cashew_set<Elt,Less,Eq,Traits> freeze(
+    const cashew_set<Elt,Less,Eq,Traits,Alloc>& s) {
+  return frozen_cashew_set<Elt,Less,Eq,Traits>(s.begin(),s.end());
+}
+
+}  // namespace cashew
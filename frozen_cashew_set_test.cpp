@@ -0,0 +1,101 @@
+#include "frozen_cashew_set.h"
+#include <cassert>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace cashew;
+using namespace std;
+
+void testEmpty() {
+  frozen_cashew_set<int32_t> f;
+  assert(f.empty() && f.size()==0);
+  assert(f.count(0)==0 && f.lower_bound(0)==nullptr);
+  f = freeze(cashew_set<int32_t>());
+  assert(f.empty() && f.count(0)==0);
+}
+
+// Sizes around block boundaries and tree level boundaries, so that padding
+// ends up in leaves as well as in internal blocks.
+template <class X> void testAgainstStdSet() {
+  using F = frozen_cashew_set<X>;
+  const size_t b = F::block_size;
+  const size_t sizes[] = {1, 2, b-1, b, b+1, b*(b+1), b*(b+1)+1,
+                          b*(b+2)-1, b*(b+2), 3000};
+  minstd_rand rng(7);
+  for(size_t n : sizes) {
+    set<X> ref;
+    while(ref.size()<n) ref.insert(X(rng()%(4*n)*2));
+    F f(ref.begin(),ref.end());
+    assert(f.size()==n);
+    vector<X> keys;
+    for(X x=0;x<X(8*n+4);++x) keys.push_back(x);
+    for(X x : keys) {
+      assert(f.count(x)==ref.count(x));
+      auto it = ref.lower_bound(x);
+      const X* p = f.lower_bound(x);
+      if(it==ref.end()) assert(p==nullptr);
+      else assert(p!=nullptr && *p==*it);
+    }
+    vector<size_t> out(keys.size());
+    size_t found = f.count_batch(keys.data(),keys.size(),out.data());
+    assert(found==n);
+    for(size_t i=0;i<keys.size();++i) assert(out[i]==ref.count(keys[i]));
+  }
+}
+
+void testFreeze() {
+  cashew_set<int32_t> s;
+  for(int i=0;i<10000;++i) s.insert(i*7919%10007);
+  for(int i=0;i<10000;i+=3) s.erase(i);
+  auto f = freeze(s);
+  assert(f.size()==s.size());
+  for(int i=-5;i<10010;++i) assert(f.count(i)==s.count(i));
+  // The original is untouched, and the copy is independent of it.
+  s.insert(-1);
+  assert(f.count(-1)==0 && s.count(-1)==1);
+
+  frozen_cashew_set<int32_t> g(std::move(f));
+  assert(g.size()==s.size()-1 && f.empty() && f.count(0)==0);
+}
+
+void testUnsortedInput() {
+  vector<int32_t> v = {1, 3, 2};
+  try {
+    frozen_cashew_set<int32_t> f(v.begin(),v.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+  v = {1, 2, 2};
+  try {
+    frozen_cashew_set<int32_t> f(v.begin(),v.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+}
+
+// Elements that own memory, to check that padding copies and half-built
+// trees get cleaned up.
+void testNonTrivialElt() {
+  set<string> ref;
+  for(int i=0;i<500;++i) ref.insert(string(20,'a'+i%26)+to_string(i));
+  frozen_cashew_set<string> f(ref.begin(),ref.end());
+  for(auto& s : ref) assert(f.count(s)==1);
+  assert(f.count("")==0 && *f.lower_bound("")==*ref.begin());
+
+  vector<string> bad(ref.begin(),ref.end());
+  swap(bad[400],bad[401]);
+  try {
+    frozen_cashew_set<string> g(bad.begin(),bad.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+}
+
+int main() {
+  testEmpty();
+  testAgainstStdSet<int32_t>();
+  testAgainstStdSet<uint64_t>();
+  testAgainstStdSet<double>();
+  testFreeze();
+  testUnsortedInput();
+  testNonTrivialElt();
+}
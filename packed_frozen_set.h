@@ -0,0 +1,423 @@
+/* A read-only set of integers, for keys that come in tight clusters, such as
+   timestamps or sequential IDs. Like frozen_cashew_set, it gets built once
+   from sorted input, and is then only searched. Unlike it, leaves don't store
+   keys at full width. Each leaf stores its smallest key as a base, and the
+   rest as narrow offsets from that base (frame of reference encoding).
+
+   A leaf is one 64-byte line, laid out as:
+
+     [ offsets ... | count | shift | base ]
+
+   where offsets take up everything but the last sizeof(key_type)+2 bytes,
+   and are each 1<<shift bytes wide. Every leaf picks whichever width, 8, 16
+   or 32 bits or full width, lets it take the most keys. Dense int64_t keys
+   get 54 keys per line, where frozen_cashew_set has 8 and cashew_set 6.
+
+   Searches run on the offsets directly. The key is turned into an offset
+   once per leaf, and the kernels of cashew_node_search.h compare every lane
+   of the line at once, with the header lanes masked off.
+
+   Leaves are found through an implicit B+ tree over their largest keys,
+   stored level by level in the same array, in front of the leaves. Each
+   index line holds block_size full-width keys, and block k of a level has
+   children k*(block_size+1)+i on the level below, just like the blocks of
+   frozen_cashew_set. Slots with no child are padding, and hold the largest
+   key_type value.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "aligned_unique.h"
+#include "cashew_node_search.h"
+#include "cashew_set.h"
+
+namespace cashew {
+
+template <class Int, class Traits = CashewSetTraits<Int>>
+class packed_frozen_set {
+ public:
+  using key_type = Int;
+  using value_type = key_type;
+  using size_type = size_t;
+  static constexpr size_t line_nbytes = 64;
+  static constexpr size_t block_size = line_nbytes/sizeof(Int);
+  // Bytes in a leaf line that hold offsets.
+  static constexpr size_t offsets_nbytes = line_nbytes-sizeof(Int)-2;
+  static_assert(std::is_integral<Int>::value && sizeof(Int)>=4 &&
+                sizeof(Int)<=8, "Keys need to be 32-bit or 64-bit integers");
+  static_assert(Traits::cache_line_nbytes==line_nbytes,
+                "Leaves are laid out for 64-byte lines");
+
+  packed_frozen_set() = default;
+  // [first,last) must be sorted and free of duplicates. Throws
+  // std::invalid_argument otherwise.
+  template <class InputIt> packed_frozen_set(InputIt first, InputIt last);
+  template <class Alloc>
+  explicit packed_frozen_set(const cashew_set<Int,std::less<Int>,
+                             std::equal_to<Int>,Traits,Alloc>& s)
+    : packed_frozen_set(s.begin(),s.end()) {}
+  packed_frozen_set(packed_frozen_set&& that) noexcept { swap(that); }
+  packed_frozen_set& operator=(packed_frozen_set&& that) noexcept {
+    swap(that);
+    return *this;
+  }
+
+  size_type size() const noexcept { return eltCount; }
+  bool empty() const noexcept { return eltCount==0; }
+  size_type count(key_type key) const {
+    int i;
+    return !empty() && leafFind(leafFor(key),key,i)>=0;
+  }
+  // Same as cashew_set::count_batch().
+  size_type count_batch(const key_type* keys, size_type n,
+                        size_type* out) const;
+  // Sets result to the smallest element not less than key, and returns true.
+  // If there is no such element, returns false and leaves result alone.
+  bool lower_bound(key_type key, key_type& result) const;
+  // Memory taken by all lines, leaves and index.
+  size_type nbytes() const noexcept { return lineCount*line_nbytes; }
+  size_type leaf_count() const noexcept {
+    return levels.empty() ? 0 : levels.back().count;
+  }
+  void swap(packed_frozen_set& that) noexcept {
+    using std::swap;
+    swap(lines,that.lines);
+    swap(lineCount,that.lineCount);
+    swap(eltCount,that.eltCount);
+    swap(levels,that.levels);
+  }
+
+ private:
+  using ukey_type = typename std::make_unsigned<Int>::type;
+  struct line_type {
+    alignas(line_nbytes) char buf[line_nbytes];
+  };
+  // Where each level starts in lines, and how many lines it has. Index
+  // levels go from the root down, and the last level is the leaves.
+  struct level_type {
+    size_type start, count;
+  };
+  aligned_unique_ptr<line_type[]> lines{nullptr,free_deleter<line_type[]>(0)};
+  size_type lineCount = 0;
+  size_type eltCount = 0;
+  std::vector<level_type> levels;
+
+  static int leafCount(const line_type& leaf) {
+    return static_cast<unsigned char>(leaf.buf[offsets_nbytes]);
+  }
+  static int leafShift(const line_type& leaf) {
+    return leaf.buf[offsets_nbytes+1];
+  }
+  static key_type leafBase(const line_type& leaf) {
+    key_type rv;
+    std::memcpy(&rv,leaf.buf+offsets_nbytes+2,sizeof(rv));
+    return rv;
+  }
+  static ukey_type leafOffset(const line_type& leaf, int i) {
+    const char* p = leaf.buf+(i<<leafShift(leaf));
+    switch(leafShift(leaf)) {
+      case 0: return static_cast<unsigned char>(*p);
+      case 1: { uint16_t x; std::memcpy(&x,p,2); return x; }
+      case 2: { uint32_t x; std::memcpy(&x,p,4); return x; }
+      default: { uint64_t x; std::memcpy(&x,p,8); return x; }
+    }
+  }
+  // Largest offset that fits in 1<<shift bytes.
+  static ukey_type offsetMax(int shift) {
+    return (size_t(1)<<shift)>=sizeof(Int)
+      ? std::numeric_limits<ukey_type>::max()
+      : ukey_type((ukey_type(1)<<(8<<shift))-1);
+  }
+  static void setLeafOffset(line_type& leaf, int shift, size_type i,
+                            ukey_type offset) {
+    char* p = leaf.buf+(i<<shift);
+    switch(shift) {
+      case 0: *p = char(offset); break;
+      case 1: { uint16_t x = offset; std::memcpy(p,&x,2); break; }
+      case 2: { uint32_t x = offset; std::memcpy(p,&x,4); break; }
+      default: { uint64_t x = offset; std::memcpy(p,&x,8); break; }
+    }
+  }
+  static key_type eltAt(const line_type& leaf, int i) {
+    return key_type(ukey_type(leafBase(leaf))+leafOffset(leaf,i));
+  }
+
+  // Child of an index line that key is under.
+  static int indexLessCount(const line_type& line, key_type key);
+  // Looks for key in leaf. Returns its index, or -1 if it isn't there. Either
+  // way, sets lessCount to how many keys in leaf are less than key.
+  static int leafFind(const line_type& leaf, key_type key, int& lessCount);
+  static int offsetFind(const line_type& leaf, ukey_type offset,
+                        int& lessCount);
+#if CASHEW_X86_DISPATCH
+  template <class Lane>
+  static int laneFind(CashewSearchTier tier, const line_type& leaf,
+                      ukey_type offset, int& lessCount);
+#endif
+  // The only leaf that could hold key, for keys no larger than the largest
+  // element. Larger keys end up in some leaf that doesn't have them.
+  const line_type& leafFor(key_type key) const;
+  // Clamped to the lines that exist, which only matters for keys past the
+  // largest element.
+  size_type childIndex(size_type level, size_type k, int i) const {
+    return std::min(k*(block_size+1)+i,levels[level+1].count-1);
+  }
+};
+
+template <class Int, class Traits>
+template <class InputIt>
+packed_frozen_set<Int,Traits>::packed_frozen_set(InputIt first, InputIt last) {
+  const std::vector<key_type> keys(first,last);
+  for(size_type i=1;i<keys.size();++i)
+    if(!(keys[i-1]<keys[i]))
+      throw std::invalid_argument(
+          "packed_frozen_set needs sorted, distinct input");
+  if(keys.empty()) return;
+
+  // Greedily packs as many keys as possible into each leaf, trying every
+  // width.
+  struct leaf_plan {
+    size_type first, count;
+    int shift;
+  };
+  std::vector<leaf_plan> plans;
+  for(size_type p=0;p<keys.size();) {
+    leaf_plan best{p,0,0};
+    for(int shift=0;(size_t(1)<<shift)<=sizeof(Int);++shift) {
+      const size_type cap = std::min(offsets_nbytes>>shift,keys.size()-p);
+      size_type n = 0;
+      while(n<cap && ukey_type(ukey_type(keys[p+n])-ukey_type(keys[p]))
+                     <=offsetMax(shift)) ++n;
+      if(n>best.count) best = leaf_plan{p,n,shift};
+    }
+    plans.push_back(best);
+    p += best.count;
+  }
+
+  // Line counts of each level, from the leaves up to a single root line.
+  std::vector<size_type> counts{plans.size()};
+  while(counts.back()>1)
+    counts.push_back((counts.back()+block_size)/(block_size+1));
+  for(size_type h=counts.size();h-->0;) {
+    levels.push_back(level_type{lineCount,counts[h]});
+    lineCount += counts[h];
+  }
+  lines = make_aligned_unique<line_type[],line_nbytes>(lineCount);
+  std::memset(static_cast<void*>(lines.get()),0,lineCount*line_nbytes);
+
+  const level_type& leaves = levels.back();
+  for(size_type j=0;j<plans.size();++j) {
+    line_type& leaf = lines[leaves.start+j];
+    const leaf_plan& plan = plans[j];
+    const ukey_type base = ukey_type(keys[plan.first]);
+    for(size_type i=0;i<plan.count;++i)
+      setLeafOffset(leaf,plan.shift,i,ukey_type(keys[plan.first+i])-base);
+    leaf.buf[offsets_nbytes] = char(plan.count);
+    leaf.buf[offsets_nbytes+1] = char(plan.shift);
+    std::memcpy(leaf.buf+offsets_nbytes+2,&keys[plan.first],sizeof(Int));
+  }
+
+  // Slot i of block k, on a level h levels above the leaves, holds the
+  // largest key under child k*(block_size+1)+i, which covers span leaves.
+  size_type span = 1;
+  for(size_type lv=levels.size()-1;lv-->0;) {
+    for(size_type k=0;k<levels[lv].count;++k) {
+      key_type* block = reinterpret_cast<key_type*>(
+          lines[levels[lv].start+k].buf);
+      for(size_type i=0;i<block_size;++i) {
+        const size_type c = k*(block_size+1)+i;
+        if(c*span>=plans.size()) {
+          block[i] = std::numeric_limits<key_type>::max();
+          continue;
+        }
+        const leaf_plan& last = plans[std::min((c+1)*span,plans.size())-1];
+        block[i] = keys[last.first+last.count-1];
+      }
+    }
+    span *= block_size+1;
+  }
+  eltCount = keys.size();
+}
+
+// Every index slot holds a valid key, padding included, so the whole line
+// gets compared.
+template <class Int, class Traits>
+int packed_frozen_set<Int,Traits>::indexLessCount(
+    const line_type& line, key_type key) {
+#if CASHEW_X86_DISPATCH
+  using lane_type = typename cashew_lane_type<sizeof(Int)>::type;
+  const CashewSearchTier tier = cashew_search_tier();
+  if(tier!=CashewSearchTier::scalar) {
+    const lane_type bias = std::is_signed<Int>::value
+      ? 0 : std::numeric_limits<lane_type>::min();
+    const uint64_t valid = (uint64_t(1)<<block_size)-1;
+    int lane, lt;
+    if(tier==CashewSearchTier::avx512)
+      lane = cashew_line_find_avx512(line.buf,lane_type(key),bias,valid,lt);
+    else if(tier==CashewSearchTier::avx2)
+      lane = cashew_line_find_avx2(line.buf,lane_type(key),bias,valid,lt);
+    else lane = cashew_line_find_sse42(line.buf,lane_type(key),bias,valid,lt);
+    // A match is the first slot not less than key.
+    return lane>=0 ? lane : lt;
+  }
+#endif
+  const key_type* block = reinterpret_cast<const key_type*>(line.buf);
+  int rv = 0;
+  for(size_type i=0;i<block_size;++i) rv += block[i]<key;
+  return rv;
+}
+
+// Keys below base are less than everything in leaf, and keys too far above
+// it greater than everything. Either way, there's no need to look.
+template <class Int, class Traits>
+int packed_frozen_set<Int,Traits>::leafFind(
+    const line_type& leaf, key_type key, int& lessCount) {
+  const key_type base = leafBase(leaf);
+  if(key<base) {
+    lessCount = 0;
+    return -1;
+  }
+  const ukey_type offset = ukey_type(ukey_type(key)-ukey_type(base));
+  if(offset>offsetMax(leafShift(leaf))) {
+    lessCount = leafCount(leaf);
+    return -1;
+  }
+  return offsetFind(leaf,offset,lessCount);
+}
+
+template <class Int, class Traits>
+int packed_frozen_set<Int,Traits>::offsetFind(
+    const line_type& leaf, ukey_type offset, int& lessCount) {
+#if CASHEW_X86_DISPATCH
+  const int shift = leafShift(leaf);
+  const CashewSearchTier tier = cashew_search_tier();
+  // As in CashewNodeSearch, SSE4.2 leaves 8-bit and 16-bit lanes to the
+  // scalar loop.
+  if(tier!=CashewSearchTier::scalar &&
+     !(tier==CashewSearchTier::sse42 && shift<2)) {
+    int lane;
+    switch(shift) {
+      case 0: lane = laneFind<int8_t>(tier,leaf,offset,lessCount); break;
+      case 1: lane = laneFind<int16_t>(tier,leaf,offset,lessCount); break;
+      case 2: lane = laneFind<int32_t>(tier,leaf,offset,lessCount); break;
+      default: lane = laneFind<int64_t>(tier,leaf,offset,lessCount); break;
+    }
+    if(lane>=0) lessCount = lane;
+    return lane;
+  }
+#endif
+  int lt = 0;
+  for(int i=0;i<leafCount(leaf);++i) {
+    const ukey_type x = leafOffset(leaf,i);
+    if(x==offset) {
+      lessCount = i;
+      return i;
+    }
+    lt += x<offset;
+  }
+  lessCount = lt;
+  return -1;
+}
+
+#if CASHEW_X86_DISPATCH
+template <class Int, class Traits>
+template <class Lane>
+int packed_frozen_set<Int,Traits>::laneFind(
+    CashewSearchTier tier, const line_type& leaf, ukey_type offset,
+    int& lessCount) {
+  // Offsets are unsigned, so they all get biased by the sign bit.
+  const Lane k = Lane(offset);
+  const Lane bias = std::numeric_limits<Lane>::min();
+  const uint64_t valid = (uint64_t(1)<<leafCount(leaf))-1;
+  if(tier==CashewSearchTier::avx512)
+    return cashew_line_find_avx512(leaf.buf,k,bias,valid,lessCount);
+  if(tier==CashewSearchTier::avx2)
+    return cashew_line_find_avx2(leaf.buf,k,bias,valid,lessCount);
+  return cashew_line_find_sse42(leaf.buf,k,bias,valid,lessCount);
+}
+#endif
+
+template <class Int, class Traits>
+auto packed_frozen_set<Int,Traits>::leafFor(key_type key) const
+    -> const line_type& {
+  size_type k = 0;
+  for(size_type lv=0;lv+1<levels.size();++lv)
+    k = childIndex(lv,k,indexLessCount(lines[levels[lv].start+k],key));
+  return lines[levels.back().start+k];
+}
+
+template <class Int, class Traits>
+bool packed_frozen_set<Int,Traits>::lower_bound(
+    key_type key, key_type& result) const {
+  if(empty()) return false;
+  const line_type& leaf = leafFor(key);
+  int i;
+  if(leafFind(leaf,key,i)<0 && i==leafCount(leaf)) return false;
+  result = eltAt(leaf,i);
+  return true;
+}
+
+// Like frozen_cashew_set::count_batch(), with lv[q] tracking which level
+// lookup q is on.
+template <class Int, class Traits>
+auto packed_frozen_set<Int,Traits>::count_batch(
+    const key_type* keys, size_type n, size_type* out) const -> size_type {
+  if(empty()) {
+    for(size_type i=0;i<n;++i) out[i] = 0;
+    return 0;
+  }
+  constexpr int slot_count = Traits::lookups_in_flight;
+  size_type lv[slot_count], blk[slot_count], pos[slot_count];
+  const size_type leafLevel = levels.size()-1;
+  size_type next = 0, rv = 0;
+  int active = 0;
+  for(;active<slot_count && next<n;++active) {
+    lv[active] = blk[active] = 0;
+    pos[active] = next++;
+  }
+  while(active>0) {
+    for(int q=0;q<active;++q) {
+      const key_type key = keys[pos[q]];
+      const line_type& line = lines[levels[lv[q]].start+blk[q]];
+      if(lv[q]<leafLevel) {
+        blk[q] = childIndex(lv[q],blk[q],indexLessCount(line,key));
+        ++lv[q];
+        prefetch_line(&lines[levels[lv[q]].start+blk[q]]);
+        continue;
+      }
+      int lt;
+      const bool found = leafFind(line,key,lt)>=0;
+      out[pos[q]] = found;
+      rv += found;
+      if(next<n) {
+        lv[q] = blk[q] = 0;
+        pos[q] = next++;
+      }else {
+        --active;
+        lv[q] = lv[active];
+        blk[q] = blk[active];
+        pos[q] = pos[active];
+        --q;
+      }
+    }
+  }
+  return rv;
+}
+
+// Makes a packed copy of s. s itself is left alone.
+template <class Int, class Traits, class Alloc>
+packed_frozen_set<Int,Traits> freeze_packed(
+    const cashew_set<Int,std::less<Int>,std::equal_to<Int>,Traits,Alloc>& s) {
+  return packed_frozen_set<Int,Traits>(s.begin(),s.end());
+}
+
+}  // namespace cashew
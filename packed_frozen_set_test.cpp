@@ -0,0 +1,209 @@
+#include "packed_frozen_set.h"
+#include <cassert>
+#include <limits>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+using namespace cashew;
+using namespace std;
+
+void testEmpty() {
+  packed_frozen_set<int64_t> f;
+  int64_t x = 5;
+  assert(f.empty() && f.size()==0 && f.nbytes()==0);
+  assert(f.count(0)==0 && !f.lower_bound(0,x) && x==5);
+  size_t out = 1;
+  assert(f.count_batch(&x,1,&out)==0 && out==0);
+  f = freeze_packed(cashew_set<int64_t>());
+  assert(f.empty() && f.count(0)==0);
+}
+
+// Checks every key in ref, its neighbours, the extremes, and probes.
+template <class X>
+void checkAgainst(const set<X>& ref, vector<X> keys = vector<X>()) {
+  using U = typename make_unsigned<X>::type;
+  packed_frozen_set<X> f(ref.begin(),ref.end());
+  assert(f.size()==ref.size());
+  keys.push_back(numeric_limits<X>::min());
+  keys.push_back(numeric_limits<X>::max());
+  for(X x : ref) {
+    keys.push_back(x);
+    keys.push_back(X(U(x)-1));
+    keys.push_back(X(U(x)+1));
+  }
+  for(X x : keys) {
+    assert(f.count(x)==ref.count(x));
+    auto it = ref.lower_bound(x);
+    X y;
+    if(it==ref.end()) assert(!f.lower_bound(x,y));
+    else assert(f.lower_bound(x,y) && y==*it);
+  }
+  vector<size_t> out(keys.size());
+  size_t found = f.count_batch(keys.data(),keys.size(),out.data());
+  size_t expected = 0;
+  for(size_t i=0;i<keys.size();++i) {
+    assert(out[i]==ref.count(keys[i]));
+    expected += out[i];
+  }
+  assert(found==expected);
+}
+
+// Dense runs that fit 8-bit offsets, sparse keys that need full width, and
+// clusters in between, each at sizes around leaf and index boundaries.
+template <class X> void testAgainstStdSet() {
+  using U = typename make_unsigned<X>::type;
+  minstd_rand rng(11);
+  const size_t sizes[] = {1, 2, 53, 54, 55, 300, 1000, 20000};
+  for(size_t n : sizes) {
+    set<X> dense, sparse, clustered;
+    X x = numeric_limits<X>::min();
+    while(dense.size()<n) dense.insert(x += 1+rng()%3);
+    dense.insert(numeric_limits<X>::max());
+    while(sparse.size()<n)
+      sparse.insert(X(uint64_t(rng())<<32^rng()));
+    U u = U(-12345);
+    while(clustered.size()<n) {
+      u += rng()%8==0 ? U(rng()) : U(rng()%300);
+      clustered.insert(X(u));
+    }
+    checkAgainst(dense);
+    checkAgainst(sparse);
+    checkAgainst(clustered);
+  }
+}
+
+// A leaf of n keys: base, base+1, ..., and base+span last. Returns its
+// leaf count, after checking it against std::set, with probes around each
+// width's limit.
+template <class X> size_t checkSpan(X base, size_t n,
+                                    typename make_unsigned<X>::type span) {
+  using U = typename make_unsigned<X>::type;
+  set<X> ref;
+  for(size_t i=0;i+1<n;++i) ref.insert(X(U(base)+i));
+  ref.insert(X(U(base)+span));
+  assert(ref.size()==n);
+  vector<X> probes = {X(U(base)+span/2)};
+  for(size_t bits=8;bits<8*sizeof(X);bits*=2) {
+    const U limit = U(1)<<bits;
+    if(limit>span) break;
+    for(U d : {limit-1,limit,limit+1}) probes.push_back(X(U(base)+d));
+  }
+  checkAgainst(ref,probes);
+  return packed_frozen_set<X>(ref.begin(),ref.end()).leaf_count();
+}
+
+// Leaves whose keys span right up to the largest offset each width holds,
+// or one past it, which needs a wider width and so splits the keys over two
+// leaves. Then full-width leaves spanning more than 32 bits of offset, up to
+// numeric_limits<X>::min() and max() together, the widest span there is.
+template <class X> void testWideSpans() {
+  using U = typename make_unsigned<X>::type;
+  const size_t offsets_nbytes = packed_frozen_set<X>::offsets_nbytes;
+  for(size_t width=1;width<sizeof(X);width*=2) {
+    const size_t n = offsets_nbytes/width;
+    const U span = U((U(1)<<(8*width))-1);
+    // The middle base straddles where the sign bit flips.
+    const U signBit = is_signed<X>::value ? 0 : U(-1)/2+1;
+    for(X base : {numeric_limits<X>::min(),X(signBit-span/2),
+                  X(U(numeric_limits<X>::max())-span)}) {
+      assert(checkSpan(base,n,span)==1);
+      assert(checkSpan(base,n,U(span+1))==2);
+    }
+  }
+  const size_t n = offsets_nbytes/sizeof(X);
+  const U spans[] = {U(U(1)<<(4*sizeof(X)+1)),U(U(-1)/2),U(-1)};
+  for(U span : spans) {
+    assert(checkSpan(numeric_limits<X>::min(),n,span)==1);
+    assert(checkSpan(X(U(numeric_limits<X>::max())-span),n,span)==1);
+  }
+}
+
+// Runs the tests once per search tier this machine supports.
+void testSearchTiers() {
+  const CashewSearchTier best = cashew_best_search_tier();
+  for(auto tier : {CashewSearchTier::scalar,CashewSearchTier::sse42,
+                   CashewSearchTier::avx2,CashewSearchTier::avx512}) {
+    if(!cashew_force_search_tier(tier)) continue;
+    testAgainstStdSet<int32_t>();
+    testAgainstStdSet<uint32_t>();
+    testAgainstStdSet<int64_t>();
+    testAgainstStdSet<uint64_t>();
+    testWideSpans<int32_t>();
+    testWideSpans<uint32_t>();
+    testWideSpans<int64_t>();
+    testWideSpans<uint64_t>();
+  }
+  assert(cashew_force_search_tier(best));
+}
+
+void testCompression() {
+  // Timestamps a few ticks apart fit 8-bit offsets, 54 to a line.
+  vector<int64_t> v;
+  for(int64_t t=1500000000000LL;v.size()<100000;t+=1+v.size()%3)
+    v.push_back(t);
+  packed_frozen_set<int64_t> f(v.begin(),v.end());
+  assert(f.leaf_count()==(v.size()+53)/54);
+  // Index lines included.
+  assert(f.nbytes()*5<v.size()*sizeof(int64_t));
+  // Spread out keys still take a line per 6, like cashew_set nodes.
+  v.clear();
+  for(int64_t i=0;i<600;++i) v.push_back(i<<40);
+  packed_frozen_set<int64_t> g(v.begin(),v.end());
+  assert(g.leaf_count()==100);
+}
+
+// Against the set it was frozen from, counting the set's families as the
+// slab sees them. Keys inserted in order leave every node full, which is as
+// small as a cashew_set gets.
+void testCompressionAgainstSet() {
+  using node_type = CashewSetNode<int64_t,CashewSetTraits<int64_t>>;
+  using family_slab = CashewSlabFor<node_type::family_type,
+      CashewFamilyChunks<CashewSetTraits<int64_t>>>::type;
+  const size_t before = family_slab::instance().stats().live_block_count;
+  cashew_set<int64_t> s;
+  for(int64_t t=1500000000000LL;s.size()<200000;t+=1+s.size()%3) s.insert(t);
+  const size_t families =
+    family_slab::instance().stats().live_block_count-before;
+  const size_t set_nbytes = families*sizeof(node_type::family_type);
+  packed_frozen_set<int64_t> f = freeze_packed(s);
+  assert(f.size()==s.size());
+  assert(f.nbytes()*6<=set_nbytes);
+}
+
+void testFreezePacked() {
+  cashew_set<uint32_t> s;
+  for(uint32_t i=0;i<10000;++i) s.insert(i*7919%10007);
+  for(uint32_t i=0;i<10000;i+=3) s.erase(i);
+  auto f = freeze_packed(s);
+  assert(f.size()==s.size());
+  for(uint32_t i=0;i<10010;++i) assert(f.count(i)==s.count(i));
+  s.insert(20000);
+  assert(f.count(20000)==0 && s.count(20000)==1);
+
+  packed_frozen_set<uint32_t> g(std::move(f));
+  assert(g.size()==s.size()-1 && f.empty() && f.count(1)==0);
+}
+
+void testUnsortedInput() {
+  vector<int32_t> v = {1, 3, 2};
+  try {
+    packed_frozen_set<int32_t> f(v.begin(),v.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+  v = {1, 2, 2};
+  try {
+    packed_frozen_set<int32_t> f(v.begin(),v.end());
+    assert(false);
+  }catch(const invalid_argument&) {}
+}
+
+int main() {
+  testEmpty();
+  testSearchTiers();
+  testCompression();
+  testCompressionAgainstSet();
+  testFreezePacked();
+  testUnsortedInput();
+}
@@ -0,0 +1,353 @@
+// Like aligned_unique.h, but for objects that get allocated and freed often,
+// all of the same size. Provides:
+//   * CashewSlab<nbytes,align,Chunks>: A process-wide pool of nbytes-sized
+//       blocks, aligned to `align`. Blocks are carved out of large chunks.
+//       Each thread keeps a few freed blocks of its own to reuse, so most
+//       allocations and frees don't take a lock. The rest go back to the
+//       chunk they came from, and chunks with no blocks in use go back to
+//       Chunks, except for one spare. Thread-safe.
+//   * make_slab_unique<T,align,Chunks>: Like make_aligned_unique<T,align>,
+//       but takes memory from CashewSlab<sizeof(T),align,Chunks>.
+//   * slab_unique_ptr<T,align,Chunks>: Type alias of std::unique_ptr with a
+//       deleter that returns memory to the right slab. Same size as a plain
+//       pointer.
+//   * cashew_slab_allocator<T,Chunks>: A standard Allocator that hands out
+//       single objects from a CashewSlab. This is what cashew_set uses by
+//       default.
+// Chunks decides where chunks come from, and where they go back to. By
+// default, that's aligned_alloc and free. See cashew_huge_pages.h for another
+// option.
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "aligned_unique.h"
+
+namespace cashew {
+
+// For one CashewSlab instance.
+struct CashewSlabStats {
+  size_t chunk_count;           // Chunks held right now, including the spare.
+  size_t chunk_nbytes;          // Total size of those chunks.
+  size_t released_chunk_count;  // Chunks given back to Chunks so far.
+  size_t live_block_count;      // Blocks handed out, but not yet freed.
+};
+
+// Chunks of around 256 KB from aligned_alloc.
+struct CashewAlignedChunks {
+  static constexpr size_t target_chunk_nbytes = 256*1024;
+  // Returns nullptr if out of memory.
+  static void* allocate(size_t align, size_t nbytes) {
+    return aligned_alloc(align,nbytes);
+  }
+  static void deallocate(void* p, size_t) noexcept { std::free(p); }
+};
+
+template <size_t nbytes, size_t align, class Chunks = CashewAlignedChunks>
+class CashewSlab {
+  static_assert(nbytes%align == 0,
+      "Object size needs to be a multiple of alignment");
+  static_assert(nbytes>=sizeof(void*), "Blocks are too small for free lists");
+ public:
+  // Big objects get at least one block per chunk.
+  static constexpr size_t blocks_per_chunk =
+    Chunks::target_chunk_nbytes>=nbytes ? Chunks::target_chunk_nbytes/nbytes
+                                        : 1;
+  // Most freed blocks a thread keeps for itself. Past that, it gives half of
+  // them back in one go, and it takes as many at once when it runs out.
+  static constexpr size_t thread_cache_max =
+    blocks_per_chunk<16 ? 1 : blocks_per_chunk<512 ? blocks_per_chunk/16 : 32;
+
+  // Never destroyed, so that objects freed during static destruction still
+  // have somewhere to go.
+  static CashewSlab& instance() {
+    static CashewSlab* slab = new CashewSlab;
+    return *slab;
+  }
+  // Returns uninitialized memory. Throws std::bad_alloc if out of memory.
+  void* allocate() {
+    ThreadCache& c = cache_;
+    if(c.head==nullptr) return refill(c);
+    FreeBlock* rv = c.head;
+    c.head = rv->next;
+    c.count--;
+    return rv;
+  }
+  // p can come from any thread.
+  void deallocate(void* p) noexcept {
+    ThreadCache& c = cache_;
+    if(c.count>=c.limit) return spill(c,p);
+    c.head = new (p) FreeBlock{c.head};
+    c.count++;
+  }
+  // Gives back the calling thread's cached blocks first, so that counts are
+  // exact if only one thread uses the slab. Blocks cached by other threads
+  // count as live.
+  CashewSlabStats stats() {
+    ThreadCache& c = cache_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    giveBack(c,c.count);
+    return stats_;
+  }
+
+ private:
+  struct FreeBlock { FreeBlock* next; };
+  // Plain data, so that it is still usable after this thread's Flusher is
+  // gone, from destructors that run later.
+  struct ThreadCache {
+    FreeBlock* head;
+    size_t count;
+    size_t limit;  // 0 until the thread has a Flusher, and after it's gone.
+    bool dead;     // The Flusher is gone. Frees go straight to the chunks.
+  };
+  // Gives back the thread's cache when the thread exits.
+  struct Flusher {
+    Flusher() { cache_.limit = thread_cache_max; }
+    ~Flusher() {
+      ThreadCache& c = cache_;
+      CashewSlab& slab = instance();
+      std::lock_guard<std::mutex> lock(slab.mutex_);
+      slab.giveBack(c,c.count);
+      c.limit = 0;
+      c.dead = true;
+    }
+  };
+  struct Chunk {
+    char* base = nullptr;
+    FreeBlock* free = nullptr;  // Blocks given back to this chunk.
+    size_t carved = 0;          // Blocks ever taken from base onwards.
+    size_t live = 0;            // Blocks out, to callers or thread caches.
+    // Links in partial_, if listed.
+    Chunk* prev = nullptr;
+    Chunk* next = nullptr;
+    bool listed = false;
+  };
+  static constexpr size_t chunk_nbytes = blocks_per_chunk*nbytes;
+
+  static thread_local ThreadCache cache_;
+  std::mutex mutex_;
+  std::vector<Chunk*> chunks_;  // Sorted by base, to find a block's chunk.
+  Chunk* partial_ = nullptr;    // Chunks with some blocks out, and some left.
+  Chunk* spare_ = nullptr;      // A chunk with no blocks out, kept for later.
+  CashewSlabStats stats_ = {};
+
+  CashewSlab() = default;
+  // Makes sure the thread gets a Flusher. Returns false if it's already
+  // gone, because the thread is exiting.
+  static bool adopt(ThreadCache& c) {
+    if(c.dead) return false;
+    static thread_local Flusher flusher;
+    (void)flusher;
+    return true;
+  }
+  void* refill(ThreadCache& c);
+  void spill(ThreadCache& c, void* p) noexcept;
+  void giveBack(ThreadCache& c, size_t n) noexcept {
+    for(;n>0;--n) {
+      FreeBlock* p = c.head;
+      c.head = p->next;
+      c.count--;
+      putBlock(p);
+    }
+  }
+  void* takeBlock();
+  void putBlock(void* p) noexcept;
+  Chunk* newChunk();
+  void retire(Chunk* chunk) noexcept;
+  void link(Chunk* chunk) noexcept {
+    chunk->prev = nullptr;
+    chunk->next = partial_;
+    if(partial_!=nullptr) partial_->prev = chunk;
+    partial_ = chunk;
+    chunk->listed = true;
+  }
+  void unlink(Chunk* chunk) noexcept {
+    if(chunk->prev!=nullptr) chunk->prev->next = chunk->next;
+    else partial_ = chunk->next;
+    if(chunk->next!=nullptr) chunk->next->prev = chunk->prev;
+    chunk->listed = false;
+  }
+  static bool baseLess(const void* p, const Chunk* chunk) {
+    return std::less<const void*>()(p,chunk->base);
+  }
+};
+
+template <size_t nbytes, size_t align, class Chunks>
+thread_local typename CashewSlab<nbytes,align,Chunks>::ThreadCache
+  CashewSlab<nbytes,align,Chunks>::cache_ = {};
+
+// The thread's cache is empty. Fills up half of it, but only from chunks we
+// already have: starting a new chunk just for the cache would keep it from
+// ever being released.
+template <size_t nbytes, size_t align, class Chunks>
+void* CashewSlab<nbytes,align,Chunks>::refill(ThreadCache& c) {
+  const size_t n = adopt(c) ? (c.limit+1)/2 : 1;
+  std::lock_guard<std::mutex> lock(mutex_);
+  void* rv = takeBlock();
+  for(size_t i=1;i<n && (partial_!=nullptr || spare_!=nullptr);++i) {
+    c.head = new (takeBlock()) FreeBlock{c.head};
+    c.count++;
+  }
+  return rv;
+}
+
+// The thread's cache is full, or the thread has no cache: either this is
+// its first free, or it's exiting.
+template <size_t nbytes, size_t align, class Chunks>
+void CashewSlab<nbytes,align,Chunks>::spill(ThreadCache& c, void* p) noexcept {
+  if(adopt(c) && c.count<c.limit) {
+    c.head = new (p) FreeBlock{c.head};
+    c.count++;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  putBlock(p);
+  giveBack(c,c.count/2);
+}
+
+template <size_t nbytes, size_t align, class Chunks>
+void* CashewSlab<nbytes,align,Chunks>::takeBlock() {
+  Chunk* chunk = partial_;
+  if(chunk==nullptr) {
+    chunk = spare_!=nullptr ? spare_ : newChunk();
+    spare_ = nullptr;
+    link(chunk);
+  }
+  void* rv;
+  if(chunk->free!=nullptr) {
+    rv = chunk->free;
+    chunk->free = chunk->free->next;
+  }else rv = chunk->base+chunk->carved++*nbytes;
+  if(chunk->free==nullptr && chunk->carved==blocks_per_chunk) unlink(chunk);
+  chunk->live++;
+  stats_.live_block_count++;
+  return rv;
+}
+
+template <size_t nbytes, size_t align, class Chunks>
+void CashewSlab<nbytes,align,Chunks>::putBlock(void* p) noexcept {
+  Chunk* chunk =
+    *(std::upper_bound(chunks_.begin(),chunks_.end(),p,baseLess)-1);
+  chunk->free = new (p) FreeBlock{chunk->free};
+  stats_.live_block_count--;
+  if(--chunk->live==0) retire(chunk);
+  else if(!chunk->listed) link(chunk);
+}
+
+template <size_t nbytes, size_t align, class Chunks>
+auto CashewSlab<nbytes,align,Chunks>::newChunk() -> Chunk* {
+  std::unique_ptr<Chunk> chunk(new Chunk);
+  // Once we have the memory, nothing can throw.
+  chunks_.reserve(chunks_.size()+1);
+  chunk->base = static_cast<char*>(Chunks::allocate(align,chunk_nbytes));
+  if(chunk->base==nullptr) throw std::bad_alloc();
+  chunks_.insert(std::upper_bound(chunks_.begin(),chunks_.end(),
+                                  chunk->base,baseLess),chunk.get());
+  stats_.chunk_count++;
+  stats_.chunk_nbytes += chunk_nbytes;
+  return chunk.release();
+}
+
+// No blocks are out. Keeps the chunk as the spare, or gives it back if we
+// already have one.
+template <size_t nbytes, size_t align, class Chunks>
+void CashewSlab<nbytes,align,Chunks>::retire(Chunk* chunk) noexcept {
+  if(chunk->listed) unlink(chunk);
+  chunk->free = nullptr;
+  chunk->carved = 0;
+  if(spare_==nullptr) {
+    spare_ = chunk;
+    return;
+  }
+  chunks_.erase(std::upper_bound(chunks_.begin(),chunks_.end(),
+                                 chunk->base,baseLess)-1);
+  Chunks::deallocate(chunk->base,chunk_nbytes);
+  stats_.chunk_count--;
+  stats_.chunk_nbytes -= chunk_nbytes;
+  stats_.released_chunk_count++;
+  delete chunk;
+}
+
+template <class T, size_t align, class Chunks = CashewAlignedChunks>
+class slab_deleter {
+ public:
+  void operator()(T* p) noexcept {
+    p->~T();
+    CashewSlab<sizeof(T),align,Chunks>::instance().deallocate(p);
+  }
+};
+
+template <class T, size_t align, class Chunks = CashewAlignedChunks>
+using slab_unique_ptr = std::unique_ptr<T, slab_deleter<T,align,Chunks>>;
+
+template <class T, size_t align, class Chunks = CashewAlignedChunks,
+          class... Args>
+slab_unique_ptr<T,align,Chunks> make_slab_unique(Args&&... args) {
+  auto& slab = CashewSlab<sizeof(T),align,Chunks>::instance();
+  void* p = slab.allocate();
+  try {
+    return slab_unique_ptr<T,align,Chunks>(
+        new (p) T(std::forward<Args>(args)...));
+  }catch(...) {
+    slab.deallocate(p);
+    throw;
+  }
+}
+
+// Allocations of one object come from CashewSlab, aligned to alignof(T).
+// Anything bigger goes straight to aligned_alloc. Stateless, so all instances
+// compare equal.
+// Kept out of cashew_slab_allocator, so that the allocator can be named
+// before T is complete.
+template <class T, class Chunks>
+struct CashewSlabFor {
+  static constexpr size_t align =
+    alignof(T)<sizeof(void*) ? sizeof(void*) : alignof(T);
+  static constexpr size_t block_nbytes = (sizeof(T)+align-1)/align*align;
+  using type = CashewSlab<block_nbytes,align,Chunks>;
+};
+
+template <class T, class Chunks = CashewAlignedChunks>
+class cashew_slab_allocator {
+  using slab_for = CashewSlabFor<T,Chunks>;
+ public:
+  using value_type = T;
+  template <class U> struct rebind {
+    using other = cashew_slab_allocator<U,Chunks>;
+  };
+
+  cashew_slab_allocator() = default;
+  template <class U>
+    cashew_slab_allocator(const cashew_slab_allocator<U,Chunks>&) noexcept {}
+
+  T* allocate(size_t n) {
+    if(n==1) return static_cast<T*>(slab_for::type::instance().allocate());
+    const size_t align = slab_for::align;
+    void* p = aligned_alloc(align,(n*sizeof(T)+align-1)/align*align);
+    if(p==nullptr) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+  void deallocate(T* p, size_t n) noexcept {
+    if(n==1) slab_for::type::instance().deallocate(p);
+    else std::free(p);
+  }
+};
+
+template <class T, class U, class Chunks>
+bool operator==(const cashew_slab_allocator<T,Chunks>&,
+                const cashew_slab_allocator<U,Chunks>&) noexcept {
+  return true;
+}
+template <class T, class U, class Chunks>
+bool operator!=(const cashew_slab_allocator<T,Chunks>&,
+                const cashew_slab_allocator<U,Chunks>&) noexcept {
+  return false;
+}
+
+}  // namespace cashew
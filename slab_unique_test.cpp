@@ -0,0 +1,127 @@
+#include "slab_unique.h"
+#include "cashew_set.h"
+#include <atomic>
+#include <cassert>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+using namespace cashew;
+using namespace std;
+
+constexpr size_t goodAlign = 64;
+
+struct alignas(goodAlign) Block {
+  static atomic<int> live;
+  int x;
+  explicit Block(int x) : x(x) {
+    if(x<0) throw invalid_argument("negative");
+    live++;
+  }
+  ~Block() { live--; }
+};
+atomic<int> Block::live(0);
+
+using BlockSlab = CashewSlab<sizeof(Block),goodAlign>;
+
+void testReuse() {
+  static_assert(sizeof(slab_unique_ptr<Block,goodAlign>)==sizeof(Block*),
+      "slab_unique_ptr should be a plain pointer");
+  const CashewSlabStats before = BlockSlab::instance().stats();
+  vector<slab_unique_ptr<Block,goodAlign>> v;
+  set<Block*> seen;
+  const size_t n = 3*BlockSlab::blocks_per_chunk;
+  for(size_t i=0;i<n;++i) {
+    v.push_back(make_slab_unique<Block,goodAlign>(int(i)));
+    assert(reinterpret_cast<size_t>(v.back().get())%goodAlign==0);
+    assert(seen.insert(v.back().get()).second);
+  }
+  assert(Block::live==int(n));
+  CashewSlabStats after = BlockSlab::instance().stats();
+  assert(after.chunk_count-before.chunk_count<=3);
+  assert(after.live_block_count-before.live_block_count==n);
+
+  // Freed blocks get reused before any new chunk is allocated. Every chunk
+  // still has blocks in use, so none of them go back.
+  for(size_t i=0;i<n;i+=2) v[i].reset();
+  assert(BlockSlab::instance().stats().chunk_count==after.chunk_count);
+  for(size_t i=0;i<n;i+=2) {
+    v[i] = make_slab_unique<Block,goodAlign>(int(i));
+    assert(seen.count(v[i].get()));
+  }
+  after = BlockSlab::instance().stats();
+  assert(after.chunk_count-before.chunk_count<=3);
+  assert(after.released_chunk_count==before.released_chunk_count);
+
+  // Once nothing is in use, all chunks but one spare go back.
+  v.clear();
+  assert(Block::live==0);
+  after = BlockSlab::instance().stats();
+  assert(after.live_block_count==before.live_block_count);
+  assert(after.chunk_count<=1);
+  assert(after.released_chunk_count>=before.released_chunk_count+2);
+  assert(after.chunk_nbytes==after.chunk_count*BlockSlab::blocks_per_chunk*
+                             sizeof(Block));
+}
+
+// Blocks freed on a different thread than they were allocated on still go
+// back to their chunks, once that thread exits.
+void testThreads() {
+  const CashewSlabStats before = BlockSlab::instance().stats();
+  vector<slab_unique_ptr<Block,goodAlign>> v[4];
+  vector<thread> threads;
+  for(int t=0;t<4;++t) threads.emplace_back([&v,t] {
+    for(size_t i=0;i<2*BlockSlab::blocks_per_chunk;++i) {
+      v[t].push_back(make_slab_unique<Block,goodAlign>(int(i)));
+      if(i%3==0) v[t].pop_back();
+    }
+  });
+  for(auto& t : threads) t.join();
+  threads.clear();
+  set<Block*> seen;
+  for(auto& x : v) for(auto& p : x) assert(seen.insert(p.get()).second);
+  assert(BlockSlab::instance().stats().live_block_count==
+         before.live_block_count+seen.size());
+  for(int t=0;t<4;++t) threads.emplace_back([&v,t] { v[(t+1)%4].clear(); });
+  for(auto& t : threads) t.join();
+  const CashewSlabStats after = BlockSlab::instance().stats();
+  assert(after.live_block_count==before.live_block_count);
+  assert(after.chunk_count<=1);
+}
+
+// A throwing constructor gives its block back.
+void testThrowingCtor() {
+  const size_t live = BlockSlab::instance().stats().live_block_count;
+  try {
+    make_slab_unique<Block,goodAlign>(-1);
+    assert(false);
+  }catch(const invalid_argument&) {}
+  assert(BlockSlab::instance().stats().live_block_count==live);
+}
+
+// The point of all this: far fewer trips to the system allocator than there
+// are families, and every family is freed with the set.
+void testCashewSetFamilies() {
+  using node_type = CashewSetNode<int32_t,CashewSetTraits<int32_t>>;
+  using FamilySlab = CashewSlab<sizeof(node_type::family_type),goodAlign>;
+  const CashewSlabStats before = FamilySlab::instance().stats();
+  {
+    cashew_set<int32_t> s;
+    for(int i=0;i<100000;++i) s.insert(i*7919%100003);
+    const CashewSlabStats after = FamilySlab::instance().stats();
+    const size_t families = after.live_block_count-before.live_block_count;
+    // Each family holds children_per_node nodes, which are at most full.
+    const size_t per_family = CashewSetTraits<int32_t>::children_per_node;
+    assert(families*per_family*per_family>100000);
+    assert((after.chunk_count-before.chunk_count)*50<families);
+  }
+  assert(FamilySlab::instance().stats().live_block_count==
+         before.live_block_count);
+}
+
+int main() {
+  testReuse();
+  testThreads();
+  testThrowingCtor();
+  testCashewSetFamilies();
+}